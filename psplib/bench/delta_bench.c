@@ -0,0 +1,140 @@
+/* psplib/bench/delta_bench.c
+   Host benchmark for the pl_delta kernels
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Reports GB/s for XOR, delta encode and delta apply next to memcpy, */
+/* for state sizes from 64 kB to 4 MB. Each state differs from its    */
+/* base in short runs scattered over a few percent of the buffer,     */
+/* which is roughly what consecutive emulator savestates look like    */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pl_delta.h"
+
+static double get_time();
+static void make_states(unsigned char *base,
+                        unsigned char *state,
+                        int size);
+
+int main(int argc, char **argv)
+{
+  static const int sizes[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+  unsigned char *base, *state, *copy, *delta;
+  double start, elapsed, gb;
+  int i, n, runs, len = 0;
+
+  printf("%8s %10s %10s %10s %10s %8s\n",
+         "size", "memcpy", "xor", "encode", "apply", "ratio");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    int size = sizes[i];
+
+    base = (unsigned char*)malloc(size);
+    state = (unsigned char*)malloc(size);
+    copy = (unsigned char*)malloc(size);
+    delta = (unsigned char*)malloc(size * 2);
+    if (!base || !state || !copy || !delta)
+      return 1;
+
+    make_states(base, state, size);
+
+    /* Round trip must give back the state */
+    len = pl_delta_encode(base, state, size, delta, size * 2);
+    memcpy(copy, base, size);
+    if (len < 0 || !pl_delta_apply(copy, size, delta, len) ||
+        memcmp(copy, state, size) != 0)
+    {
+      fprintf(stderr, "round trip failed at %d bytes\n", size);
+      return 1;
+    }
+
+    /* About 256 MB through each kernel */
+    runs = (int)(256.0 * (1 << 20) / size) + 1;
+    gb = (double)size * runs / 1e9;
+
+    printf("%7dk", size >> 10);
+
+    start = get_time();
+    for (n = 0; n < runs; n++)
+      memcpy(copy, state, size);
+    elapsed = get_time() - start;
+    printf(" %10.2f", gb / elapsed);
+
+    start = get_time();
+    for (n = 0; n < runs; n++)
+      pl_delta_xor(copy, state, size);
+    elapsed = get_time() - start;
+    printf(" %10.2f", gb / elapsed);
+
+    start = get_time();
+    for (n = 0; n < runs; n++)
+      len = pl_delta_encode(base, state, size, delta, size * 2);
+    elapsed = get_time() - start;
+    printf(" %10.2f", gb / elapsed);
+
+    /* Applying twice restores copy, so every pass does the same work */
+    memcpy(copy, base, size);
+    start = get_time();
+    for (n = 0; n < runs; n++)
+      pl_delta_apply(copy, size, delta, len);
+    elapsed = get_time() - start;
+    printf(" %10.2f", gb / elapsed);
+
+    printf(" %6.1f:1\n", (double)size / len);
+
+    free(base);
+    free(state);
+    free(copy);
+    free(delta);
+  }
+
+  printf("(GB/s of state processed)\n");
+  return 0;
+}
+
+static double get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_states(unsigned char *base,
+                        unsigned char *state,
+                        int size)
+{
+  int i, offset, len;
+
+  srand(size);
+  for (i = 0; i < size; i++)
+    base[i] = rand();
+  memcpy(state, base, size);
+
+  /* Change about 3% of the bytes, in runs of 1-64 */
+  for (i = size / 32 / 32; i > 0; i--)
+  {
+    offset = rand() % size;
+    len = rand() % 64 + 1;
+    if (offset + len > size)
+      len = size - offset;
+    while (len--)
+      state[offset++] ^= (rand() | 1);
+  }
+}
@@ -0,0 +1,301 @@
+/* psplib/bench/pixconv_bench.c
+   Host benchmark for the pl_pixconv row converters
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Reports Mpixels/s for each PNG layout the loaders handle, next to  */
+/* the per-pixel loops the converters replaced: IRGB from image.c and */
+/* pl_image_compose_color() + copy_to_void() from pl_image.c, copied  */
+/* here as they were. Every converter's output is checked against its */
+/* old loop first                                                     */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pl_pixconv.h"
+
+#define WIDTH  1024
+#define HEIGHT 1024
+#define PASSES 16
+
+/* pl_image_format values; & 0x07 gives bytes per pixel */
+#define OLD_4444 0x02
+#define OLD_5551 0x12
+
+#define IRGB(r,g,b,a)   (((((b)>>3)&0x1F)<<10)|((((g)>>3)&0x1F)<<5)|\
+  (((r)>>3)&0x1F)|(a?0x8000:0))
+
+typedef void (*old_row_func)(int format,
+                             void *out,
+                             const uint8_t *row,
+                             unsigned int width);
+
+static double get_time();
+static int compose_color(int format,
+                         uint32_t *color,
+                         uint8_t red,
+                         uint8_t green,
+                         uint8_t blue,
+                         uint8_t alpha);
+static int copy_to_void(int format,
+                        uint32_t from,
+                        void *to);
+static void old_gray(int format, void *out, const uint8_t *row, unsigned int width);
+static void old_gray_alpha(int format, void *out, const uint8_t *row, unsigned int width);
+static void old_bgr(int format, void *out, const uint8_t *row, unsigned int width);
+static void old_bgra(int format, void *out, const uint8_t *row, unsigned int width);
+static void irgb_gray(int format, void *out, const uint8_t *row, unsigned int width);
+static void irgb_gray_alpha(int format, void *out, const uint8_t *row, unsigned int width);
+static void irgb_bgr(int format, void *out, const uint8_t *row, unsigned int width);
+static void irgb_bgra(int format, void *out, const uint8_t *row, unsigned int width);
+
+int main(int argc, char **argv)
+{
+  static const char *sources[] = { "gray", "gray+a", "bgr", "bgra" };
+  static const int bpp[] = { 1, 2, 3, 4 };
+  static const old_row_func compose_loops[] =
+    { old_gray, old_gray_alpha, old_bgr, old_bgra };
+  static const old_row_func irgb_loops[] =
+    { irgb_gray, irgb_gray_alpha, irgb_bgr, irgb_bgra };
+  static const struct
+  {
+    const char *name;
+    int dest;
+    int old_format;
+    const old_row_func *old_loops;
+  } dests[] =
+  {
+    { "5551", PL_PIXCONV_5551, OLD_5551, compose_loops },
+    { "4444", PL_PIXCONV_4444, OLD_4444, compose_loops },
+    { "5551key", PL_PIXCONV_5551_KEY, OLD_5551, irgb_loops },
+  };
+  uint8_t *src;
+  uint16_t *old_out, *new_out;
+  pl_pixconv_func convert;
+  double start, old_time, new_time, mpix;
+  int s, d, y, i, n;
+
+  src = (uint8_t*)malloc(WIDTH * HEIGHT * 4);
+  old_out = (uint16_t*)malloc(WIDTH * HEIGHT * sizeof(uint16_t));
+  new_out = (uint16_t*)malloc(WIDTH * HEIGHT * sizeof(uint16_t));
+  if (!src || !old_out || !new_out)
+    return 1;
+
+  srand(1);
+  for (i = 0; i < WIDTH * HEIGHT * 4; i++)
+    src[i] = rand();
+
+  mpix = (double)WIDTH * HEIGHT * PASSES / 1e6;
+  printf("%-8s %-8s %10s %10s %8s\n", "source", "dest", "old", "new", "speedup");
+
+  for (d = 0; d < sizeof(dests) / sizeof(dests[0]); d++)
+  {
+    for (s = 0; s < PL_PIXCONV_SOURCES; s++)
+    {
+      if (!(convert = pl_pixconv_get(s, dests[d].dest)))
+        return 1;
+
+      /* One row at a time, as the PNG loaders convert them */
+      start = get_time();
+      for (n = 0; n < PASSES; n++)
+        for (y = 0; y < HEIGHT; y++)
+          dests[d].old_loops[s](dests[d].old_format, old_out + y * WIDTH,
+                                src + y * WIDTH * bpp[s], WIDTH);
+      old_time = get_time() - start;
+
+      start = get_time();
+      for (n = 0; n < PASSES; n++)
+        for (y = 0; y < HEIGHT; y++)
+          convert(new_out + y * WIDTH, src + y * WIDTH * bpp[s], WIDTH);
+      new_time = get_time() - start;
+
+      if (memcmp(old_out, new_out, WIDTH * HEIGHT * sizeof(uint16_t)) != 0)
+      {
+        fprintf(stderr, "%s -> %s differs from the old loop\n",
+                sources[s], dests[d].name);
+        return 1;
+      }
+
+      printf("%-8s %-8s %10.1f %10.1f %7.2fx\n", sources[s], dests[d].name,
+             mpix / old_time, mpix / new_time, old_time / new_time);
+    }
+  }
+
+  printf("(Mpixels/s, %dx%d)\n", WIDTH, HEIGHT);
+
+  free(src);
+  free(old_out);
+  free(new_out);
+  return 0;
+}
+
+static double get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* pl_image.c */
+
+static int compose_color(int format,
+                         uint32_t *color,
+                         uint8_t red,
+                         uint8_t green,
+                         uint8_t blue,
+                         uint8_t alpha)
+{
+  switch (format)
+  {
+  case OLD_4444:
+    *color = (((alpha >> 4) & 0x0F) << 12) |
+             (((blue  >> 4) & 0x0F) << 8) |
+             (((green >> 4) & 0x0F) << 4) |
+                ((red >> 4) & 0x0F);
+    return 1;
+  case OLD_5551:
+    *color = (((alpha >> 7) & 0x01) << 15) |
+             (((blue  >> 3) & 0x1F) << 10) |
+             (((green >> 3) & 0x1F) << 5) |
+                ((red >> 3) & 0x1F);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int copy_to_void(int format,
+                        uint32_t from,
+                        void *to)
+{
+  switch (format & 0x07)
+  {
+  case 1:
+    *(uint8_t*)to = (uint8_t)from;
+    return 1;
+  case 2:
+    *(uint16_t*)to = (uint16_t)from;
+    return 1;
+  case 4:
+    *(uint32_t*)to = (uint32_t)from;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void old_gray(int format,
+                     void *out,
+                     const uint8_t *row,
+                     unsigned int width)
+{
+  uint8_t *pel_ptr = (uint8_t*)out;
+  uint32_t color;
+
+  for (; width; width--, row++, pel_ptr += format & 0x07)
+  {
+    compose_color(format, &color, row[0], row[0], row[0], 0xff);
+    copy_to_void(format, color, pel_ptr);
+  }
+}
+
+static void old_gray_alpha(int format,
+                           void *out,
+                           const uint8_t *row,
+                           unsigned int width)
+{
+  uint8_t *pel_ptr = (uint8_t*)out;
+  uint32_t color;
+
+  for (; width; width--, row += 2, pel_ptr += format & 0x07)
+  {
+    compose_color(format, &color, row[0], row[0], row[0], row[1]);
+    copy_to_void(format, color, pel_ptr);
+  }
+}
+
+static void old_bgr(int format,
+                    void *out,
+                    const uint8_t *row,
+                    unsigned int width)
+{
+  uint8_t *pel_ptr = (uint8_t*)out;
+  uint32_t color;
+
+  for (; width; width--, row += 3, pel_ptr += format & 0x07)
+  {
+    compose_color(format, &color, row[2], row[1], row[0], 0xff);
+    copy_to_void(format, color, pel_ptr);
+  }
+}
+
+static void old_bgra(int format,
+                     void *out,
+                     const uint8_t *row,
+                     unsigned int width)
+{
+  uint8_t *pel_ptr = (uint8_t*)out;
+  uint32_t color;
+
+  for (; width; width--, row += 4, pel_ptr += format & 0x07)
+  {
+    compose_color(format, &color, row[2], row[1], row[0], row[3]);
+    copy_to_void(format, color, pel_ptr);
+  }
+}
+
+/* image.c; always 5551 */
+
+static void irgb_gray(int format,
+                      void *out,
+                      const uint8_t *row,
+                      unsigned int width)
+{
+  unsigned short *pel = (unsigned short*)out;
+  for (; width; width--, row++)
+    *pel++ = IRGB(row[0], row[0], row[0], 1);
+}
+
+static void irgb_gray_alpha(int format,
+                            void *out,
+                            const uint8_t *row,
+                            unsigned int width)
+{
+  unsigned short *pel = (unsigned short*)out;
+  for (; width; width--, row += 2)
+    *pel++ = IRGB(row[0], row[0], row[0], row[1]);
+}
+
+static void irgb_bgr(int format,
+                     void *out,
+                     const uint8_t *row,
+                     unsigned int width)
+{
+  unsigned short *pel = (unsigned short*)out;
+  for (; width; width--, row += 3)
+    *pel++ = IRGB(row[2], row[1], row[0], 1);
+}
+
+static void irgb_bgra(int format,
+                      void *out,
+                      const uint8_t *row,
+                      unsigned int width)
+{
+  unsigned short *pel = (unsigned short*)out;
+  for (; width; width--, row += 4)
+    *pel++ = IRGB(row[2], row[1], row[0], row[3]);
+}
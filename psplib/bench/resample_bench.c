@@ -0,0 +1,126 @@
+/* psplib/bench/resample_bench.c
+   Host benchmark for the pl_resample converters
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Reports nanoseconds per output sample for each mode, converting  */
+/* the usual emulator rates to 48 kHz, mono and stereo. Input is    */
+/* fed the way the audio thread feeds it: only as much as each      */
+/* buffer needs                                                     */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pl_resample.h"
+
+#define OUT_RATE    48000
+#define OUT_SAMPLES 512     /* Per buffer, as the audio thread renders */
+#define OUT_TOTAL   (1 << 22)
+
+static double get_time();
+static double run(int mode,
+                  int in_rate,
+                  int stereo);
+
+int main(int argc, char **argv)
+{
+  static const int rates[] = { 32040, 44100 };
+  static const char *modes[] = { "linear", "sinc" };
+  double ns;
+  int mode, i, stereo;
+
+  printf("%-7s %6s %7s %10s\n", "mode", "rate", "layout", "ns/sample");
+
+  for (mode = PL_RESAMPLE_LINEAR; mode <= PL_RESAMPLE_SINC; mode++)
+  {
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+      for (stereo = 0; stereo <= 1; stereo++)
+      {
+        if ((ns = run(mode, rates[i], stereo)) < 0)
+        {
+          fprintf(stderr, "%s at %d Hz failed\n", modes[mode], rates[i]);
+          return 1;
+        }
+
+        printf("%-7s %6d %7s %10.2f\n", modes[mode], rates[i],
+               (stereo) ? "stereo" : "mono", ns);
+      }
+    }
+  }
+
+  printf("(per output frame, at %d Hz)\n", OUT_RATE);
+  return 0;
+}
+
+/* Returns ns per output frame, or -1 if the resampler fails */
+static double run(int mode,
+                  int in_rate,
+                  int stereo)
+{
+  pl_resampler rs;
+  static short noise[PL_RESAMPLE_BUFFER * 2];
+  short out[OUT_SAMPLES * 2];
+  short *input;
+  unsigned int produced, needed, space, count, channels = stereo + 1;
+  unsigned int seed = 1, total = 0, i;
+  double start, elapsed;
+
+  for (i = 0; i < PL_RESAMPLE_BUFFER * 2; i++)
+    noise[i] = (short)((seed = seed * 1103515245 + 12345) >> 16);
+
+  if (!pl_resample_init(&rs, in_rate, OUT_RATE, stereo, mode))
+    return -1;
+
+  start = get_time();
+  while (total < OUT_TOTAL)
+  {
+    for (produced = 0; produced < OUT_SAMPLES; produced += count)
+    {
+      needed = pl_resample_get_needed(&rs, OUT_SAMPLES - produced);
+      input = pl_resample_get_input(&rs, &space);
+      if (needed > space)
+        needed = space;
+
+      /* Copied in, as the audio thread copies from a voice's queue */
+      memcpy(input, noise, needed * channels * sizeof(short));
+      pl_resample_commit(&rs, needed);
+
+      if (!(count = pl_resample_process(&rs, out + produced * channels,
+                                        OUT_SAMPLES - produced)))
+        break;
+    }
+
+    if (!produced)
+    {
+      pl_resample_destroy(&rs);
+      return -1;
+    }
+    total += produced;
+  }
+  elapsed = get_time() - start;
+
+  pl_resample_destroy(&rs);
+  return elapsed * 1e9 / total;
+}
+
+static double get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,236 @@
+/* psplib/bench/snd_bench.c
+   Host benchmark for pl_snd, run through the host backends
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Drives the audio thread through init, reconfigure, capture and    */
+/* shutdown. On the null backend, checks that buffers are played at  */
+/* the port's rate before and after a reconfigure. On an unpaced wav */
+/* backend, renders a 32 kHz voice resampled to 48 kHz as fast as    */
+/* the thread can, checks the output and capture files' headers, and */
+/* reports how many times faster than real time that ran             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "pl_snd.h"
+#include "pl_snd_backend.h"
+#include "pl_resample.h"
+
+#define SAMPLES      512
+#define VOICE_RATE   32040
+#define NULL_MS      300
+#define WAV_BUFFERS  2000  /* About 21 s of audio */
+#define OUTPUT_PATH  "snd_bench_out.wav"
+#define CAPTURE_PATH "snd_bench_capture.wav"
+
+static double get_time();
+static void sleep_ms(int ms);
+static void render_tone(pl_snd_sample *buffer,
+                        unsigned int samples,
+                        void *userdata);
+static int check_rate(const char *stage,
+                      int samples,
+                      int rate);
+static int check_wav(const char *path,
+                     int rate,
+                     int channels,
+                     unsigned int min_bytes);
+
+int main(int argc, char **argv)
+{
+  pl_snd_wav_backend wav;
+  pl_snd_stats stats;
+  unsigned int phase = 0;
+  double start, elapsed;
+  unsigned int dropped;
+  int samples, ok = 1;
+
+  /* Null backend: paced like the hardware */
+  if (!(samples = pl_snd_init(SAMPLES, 1)) ||
+      !pl_snd_set_callback(0, render_tone, &phase) ||
+      !pl_snd_resume(0))
+  {
+    fprintf(stderr, "init failed\n");
+    return 1;
+  }
+
+  ok &= check_rate("init", samples, PL_SND_OUTPUT_RATE);
+
+  if (!(samples = pl_snd_reconfigure(SAMPLES * 2, 1, 44100)))
+  {
+    fprintf(stderr, "reconfigure failed\n");
+    return 1;
+  }
+  ok &= check_rate("reconfigure", samples, 44100);
+
+  if (!(samples = pl_snd_set_buffering(4, 80)))
+  {
+    fprintf(stderr, "set_buffering failed\n");
+    return 1;
+  }
+  ok &= check_rate("set_buffering", samples, 44100);
+
+  pl_snd_shutdown();
+
+  /* Wav backend, unpaced: as fast as the thread renders */
+  if (!pl_snd_wav_backend_init(&wav, OUTPUT_PATH, 0) ||
+      !pl_snd_set_backend(&wav.backend) ||
+      !(samples = pl_snd_init(SAMPLES, 1)) ||
+      !pl_snd_set_voice_rate(0, 0, VOICE_RATE, PL_RESAMPLE_SINC) ||
+      !pl_snd_set_callback(0, render_tone, &phase) ||
+      !pl_snd_start_capture(0, CAPTURE_PATH) ||
+      !pl_snd_resume(0))
+  {
+    fprintf(stderr, "wav backend setup failed\n");
+    return 1;
+  }
+
+  pl_snd_reset_stats(0);
+  start = get_time();
+  do
+  {
+    sleep_ms(1);
+    pl_snd_get_stats(0, &stats);
+  } while (stats.buffers < WAV_BUFFERS);
+  elapsed = get_time() - start;
+
+  /* Capture is written at disk speed, so some may be dropped */
+  pl_snd_stop_capture(0);
+  dropped = pl_snd_get_capture_dropped(0);
+  pl_snd_shutdown();
+  pl_snd_set_backend(NULL);
+  pl_snd_wav_backend_destroy(&wav);
+
+  ok &= check_wav(OUTPUT_PATH, PL_SND_OUTPUT_RATE, 2,
+                  WAV_BUFFERS * samples * sizeof(pl_snd_stereo_sample));
+  ok &= check_wav(CAPTURE_PATH, PL_SND_OUTPUT_RATE, 2, 1);
+  remove(OUTPUT_PATH);
+  remove(CAPTURE_PATH);
+
+  if (!ok)
+    return 1;
+
+  printf("%u buffers of %d in %.2f s: %.1fx real time\n",
+         stats.buffers, samples, elapsed,
+         (double)stats.buffers * samples / PL_SND_OUTPUT_RATE / elapsed);
+  printf("render %.3f/%.3f/%.3f ms (min/avg/max), %u underruns, "
+         "%u captured samples dropped\n", stats.render_min_ms,
+         stats.render_avg_ms, stats.render_max_ms, stats.underruns, dropped);
+  printf("(%d Hz sinc-resampled voice, stereo, %d Hz)\n",
+         VOICE_RATE, PL_SND_OUTPUT_RATE);
+
+  return 0;
+}
+
+static double get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(int ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+}
+
+/* 440 Hz at VOICE_RATE; the channel is always stereo */
+static void render_tone(pl_snd_sample *buffer,
+                        unsigned int samples,
+                        void *userdata)
+{
+  unsigned int *phase = (unsigned int*)userdata;
+  unsigned int i;
+  short value;
+
+  for (i = 0; i < samples; i++, (*phase)++)
+  {
+    value = (short)(8000 * sin(*phase * 2 * M_PI * 440 / VOICE_RATE));
+    buffer[i].stereo.l = buffer[i].stereo.r = value;
+  }
+}
+
+/* Buffers played over NULL_MS must roughly match the port's rate */
+static int check_rate(const char *stage,
+                      int samples,
+                      int rate)
+{
+  pl_snd_stats stats;
+  double start, expected;
+
+  pl_snd_reset_stats(0);
+  start = get_time();
+  sleep_ms(NULL_MS);
+  pl_snd_get_stats(0, &stats);
+  expected = (get_time() - start) * rate / samples;
+
+  printf("%-14s %5d samples at %5d Hz: %3u buffers (%.1f expected), "
+         "%u underruns\n", stage, samples, rate, stats.buffers, expected,
+         stats.underruns);
+
+  if (stats.buffers < expected * 0.5 || stats.buffers > expected * 1.5 + 2)
+  {
+    fprintf(stderr, "%s: buffers not played in real time\n", stage);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Header must describe the format and match the file's length */
+static int check_wav(const char *path,
+                     int rate,
+                     int channels,
+                     unsigned int min_bytes)
+{
+  unsigned char h[44];
+  unsigned int data_bytes;
+  long length;
+  FILE *file;
+
+  if (!(file = fopen(path, "rb")))
+  {
+    fprintf(stderr, "%s: not written\n", path);
+    return 0;
+  }
+
+  length = (fread(h, 1, sizeof(h), file) == sizeof(h) &&
+            fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+  fclose(file);
+
+  data_bytes = h[40] | (h[41] << 8) | (h[42] << 16) | ((unsigned)h[43] << 24);
+
+  if (length < 0 ||
+      memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVEfmt ", 8) != 0 ||
+      memcmp(h + 36, "data", 4) != 0 ||
+      (h[20] | (h[21] << 8)) != 1 ||
+      (h[22] | (h[23] << 8)) != channels ||
+      (h[24] | (h[25] << 8) | (h[26] << 16)) != rate ||
+      (h[34] | (h[35] << 8)) != 16 ||
+      data_bytes != length - sizeof(h) ||
+      data_bytes < min_bytes)
+  {
+    fprintf(stderr, "%s: bad header (%u data bytes, %ld in file)\n",
+            path, data_bytes, length);
+    return 0;
+  }
+
+  return 1;
+}
@@ -34,6 +34,16 @@ extern "C" {
 #define PSP_IMAGE_INDEXED 8
 #define PSP_IMAGE_16BPP   16
 
+/* Compression settings for pspImageSetPngCompression() */
+#define PSP_IMAGE_PNG_LEVEL_DEFAULT  -1 /* else zlib level, 0-9 */
+#define PSP_IMAGE_PNG_FILTER_DEFAULT -1
+#define PSP_IMAGE_PNG_FILTER_NONE    0x08
+#define PSP_IMAGE_PNG_FILTER_SUB     0x10
+#define PSP_IMAGE_PNG_FILTER_UP      0x20
+#define PSP_IMAGE_PNG_FILTER_AVG     0x40
+#define PSP_IMAGE_PNG_FILTER_PAETH   0x80
+#define PSP_IMAGE_PNG_FILTER_ALL     0xf8
+
 #define GU_PSM_T8 SCE_GXM_TEXTURE_FORMAT_P8_1BGR
 #define GU_PSM_5551 SCE_GXM_TEXTURE_FORMAT_U1U5U5U5_ABGR
 #define GU_PSM_4444 SCE_GXM_TEXTURE_FORMAT_U4U4U4U4_ABGR
@@ -63,6 +73,9 @@ typedef struct
   unsigned short PalSize;
 } PspImage;
 
+/* Called on the save thread when an async save completes */
+typedef void (*PspImageSaveCallback)(const char *path, int status, void *param);
+
 /* Create/destroy */
 PspImage* pspImageCreate(int width, int height, int bits_per_pixel);
 PspImage* pspImageCreateVram(int width, int height, int bits_per_pixel);
@@ -81,6 +94,12 @@ int       pspImageSavePng(const char *path, const PspImage* image);
 PspImage* pspImageLoadPngSCE(SceUID fp);
 PspImage* pspImageLoadPngFd(FILE *fp);
 int       pspImageSavePngFd(FILE *fp, const PspImage* image);
+void      pspImageSetPngCompression(int level, int filters);
+
+int       pspImageSavePngAsync(const char *path, const PspImage* image,
+                               PspImageSaveCallback callback, void *param);
+void      pspImageFlushSaves();
+void      pspImageShutdownSaves();
 
 int pspImageBlur(const PspImage *original, PspImage *blurred);
 int pspImageDiscardColors(const PspImage *original);
@@ -0,0 +1,51 @@
+/* psplib/pl_delta.h
+   XOR delta encoding for state snapshots
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PL_DELTA_H
+#define _PL_DELTA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A delta is a sequence of <unchanged count><changed count> varint */
+/* pairs, each followed by the changed bytes XOR'ed with the base.  */
+/* Applying a delta XORs it back in, so the same delta takes base   */
+/* to state and state to base.                                      */
+
+/* Returns encoded length, or -1 if it would exceed out_max. */
+/* A NULL base encodes the state itself                      */
+int  pl_delta_encode(const void *base,
+                     const void *state,
+                     int size,
+                     void *out,
+                     int out_max);
+/* Returns 0 if the delta is malformed or overruns the state */
+int  pl_delta_apply(void *state,
+                    int size,
+                    const void *delta,
+                    int delta_len);
+/* dest ^= src */
+void pl_delta_xor(void *dest,
+                  const void *src,
+                  int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PL_DELTA_H
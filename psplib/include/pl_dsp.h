@@ -0,0 +1,69 @@
+/* psplib/pl_dsp.h
+   Audio sample processing kernels
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PL_DSP_H
+#define _PL_DSP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Gains are Q15 fixed-point; 0x7fff is (just under) unity */
+#define PL_DSP_GAIN_UNITY 0x7fff
+
+/* Unity for ramp gains, which are Q30 for sub-sample step precision */
+#define PL_DSP_RAMP_UNITY (1 << 30)
+
+/* dest += src * gain, saturating. Samples are interleaved */
+/* stereo pairs; for mono, pass gain_l == gain_r           */
+void pl_dsp_mix_s16(short *dest,
+                    const short *src,
+                    unsigned int count,
+                    short gain_l,
+                    short gain_r);
+/* Scales each frame by gain, adding step to gain after every */
+/* frame; returns the gain following the last frame           */
+int  pl_dsp_ramp_s16(short *buf,
+                     unsigned int frames,
+                     int channels,
+                     int gain,
+                     int step);
+/* Full-scale int32 (or float in -1.0 - 1.0) to s16, rounding and */
+/* saturating. If seed is not NULL, +/-1 LSB triangular dither is */
+/* added first and seed is advanced                               */
+void pl_dsp_s32_to_s16(short *dest,
+                       const int *src,
+                       unsigned int count,
+                       unsigned int *seed);
+void pl_dsp_f32_to_s16(short *dest,
+                       const float *src,
+                       unsigned int count,
+                       unsigned int *seed);
+/* Duplicates each sample into an interleaved L/R pair */
+void pl_dsp_mono_to_stereo_s16(short *dest,
+                               const short *src,
+                               unsigned int frames);
+/* Averages each L/R pair */
+void pl_dsp_stereo_to_mono_s16(short *dest,
+                               const short *src,
+                               unsigned int frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PL_DSP_H
@@ -0,0 +1,55 @@
+/* psplib/pl_pixconv.h
+   Pixel format conversion kernels
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PL_PIXCONV_H
+#define _PL_PIXCONV_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Source layouts: 8 bits per channel, as decoded by libpng */
+/* with expansion, 16-bit stripping and png_set_bgr()       */
+#define PL_PIXCONV_GRAY       0
+#define PL_PIXCONV_GRAY_ALPHA 1
+#define PL_PIXCONV_BGR        2
+#define PL_PIXCONV_BGRA       3
+#define PL_PIXCONV_SOURCES    4
+
+/* Destination formats; all are little-endian ABGR */
+#define PL_PIXCONV_5551       0 /* Alpha bit set if alpha >= 0x80 */
+#define PL_PIXCONV_5551_KEY   1 /* Alpha bit set if alpha != 0 */
+#define PL_PIXCONV_4444       2
+#define PL_PIXCONV_8888       3
+#define PL_PIXCONV_DESTS      4
+
+/* Converts a row of width pixels */
+typedef void (*pl_pixconv_func)(void *dest,
+                                const uint8_t *src,
+                                unsigned int width);
+
+/* Returns NULL for unknown combinations */
+pl_pixconv_func pl_pixconv_get(int source,
+                               int dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PL_PIXCONV_H
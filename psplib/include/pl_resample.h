@@ -0,0 +1,77 @@
+/* psplib/pl_resample.h
+   Sample rate conversion
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PL_RESAMPLE_H
+#define _PL_RESAMPLE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PL_RESAMPLE_LINEAR 0
+#define PL_RESAMPLE_SINC   1 /* Windowed sinc, 16 taps x 256 phases */
+
+/* Input frames buffered inside the resampler */
+#define PL_RESAMPLE_BUFFER 1024
+
+typedef struct pl_resampler_t
+{
+  int mode;
+  int channels;
+  int taps;
+  int in_rate;
+  int out_rate;
+  uint64_t base_step; /* Input frames per output frame, 32.32 */
+  uint64_t step;      /* base_step, adjusted by skew */
+  uint64_t position; /* Into the input buffer, 32.32 */
+  short *coefs;      /* Sinc mode only */
+  short *buffer;
+  unsigned int buffered; /* Frames in buffer */
+} pl_resampler;
+
+int  pl_resample_init(pl_resampler *rs,
+                      int in_rate,
+                      int out_rate,
+                      int stereo,
+                      int mode);
+void pl_resample_destroy(pl_resampler *rs);
+void pl_resample_reset(pl_resampler *rs);
+/* Scales the conversion ratio by (1 + skew), e.g. for rate control */
+void pl_resample_set_skew(pl_resampler *rs,
+                          float skew);
+/* Input frames still needed to produce out_count frames */
+unsigned int pl_resample_get_needed(const pl_resampler *rs,
+                                    unsigned int out_count);
+/* Returns where the next input frames should be written, and */
+/* how many fit; follow with pl_resample_commit()              */
+short* pl_resample_get_input(pl_resampler *rs,
+                             unsigned int *space);
+void pl_resample_commit(pl_resampler *rs,
+                        unsigned int count);
+/* Produces up to out_count frames from buffered input; */
+/* returns number of frames produced                    */
+unsigned int pl_resample_process(pl_resampler *rs,
+                                 short *out,
+                                 unsigned int out_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PL_RESAMPLE_H
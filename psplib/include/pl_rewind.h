@@ -23,32 +23,145 @@
 #ifndef _PL_REWIND_H
 #define _PL_REWIND_H
 
+#include <psp2/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* A full snapshot (keyframe) is stored every 'key_interval' saves; */
+/* the saves in between hold XOR/zero-run deltas against the       */
+/* preceding snapshot                                               */
+#define PL_REWIND_DEFAULT_KEY_INTERVAL 30
+/* Snapshots that may be waiting for the compression thread */
+#define PL_REWIND_STAGING_BUFFERS      2
+/* Unit of journal writes and readahead */
+#define PL_REWIND_JOURNAL_BLOCK        (256 * 1024)
+/* Keyframes are split into pages of this size and identical */
+/* pages are stored once                                     */
+#define PL_REWIND_PAGE_SIZE            4096
+
 struct rewind_state;
+struct rewind_page;
+struct rewind_journal;
+
+/* Running totals behind pl_rewind_get_stats(); times are in */
+/* sceRtc ticks, same as pl_perf_counter                     */
+typedef struct
+{
+  uint64_t since; /* When counting started */
+  int saves;
+  uint64_t save_ticks;
+  uint64_t save_max;
+  int restores;
+  uint64_t restore_ticks;
+  uint64_t restore_max;
+  int compressed;
+  uint64_t bytes_in;  /* Raw state data compressed */
+  uint64_t bytes_out; /* Resulting snapshot data */
+} pl_rewind_counters;
 
 typedef struct
 {
   int state_data_size;
-  int state_count;
-  struct rewind_state *start;
-  struct rewind_state *current;
+  int state_count;   /* Slot capacity */
+  int arena_size;    /* Requested byte budget, or 0 */
+  int frame_target;  /* Requested frame count, or 0 */
+  int key_interval;
+  int memory_budget; /* Size of the snapshot data ring */
+  int memory_used;
+  int head;          /* Newest slot */
+  int tail;          /* Oldest slot */
+  int count;         /* Slots in use */
+  int data_head;     /* Next write offset in the data ring */
+  void *arena;
+  struct rewind_state *slots;
+  unsigned char *data;
+  void *last_state;
+  void *work_state;
+  void *encode_buffer;
+  int page_count;    /* Capacity of the page store, or 0 if disabled */
+  int pages_used;
+  int free_page;     /* Head of the free page list */
+  int bucket_mask;
+  int *buckets;      /* Page hash chains */
+  struct rewind_page *pages;
+  unsigned char *page_data;
+  int worker_thread; /* Compression thread, or -1 if saving inline */
+  int staged_sema;   /* Snapshots waiting to be compressed */
+  int free_sema;     /* Staging buffers available for saving */
+  int stage_in;
+  int stage_out;
+  volatile int worker_stop;
+  volatile int worker_error; /* A staged snapshot couldn't be stored */
+  void *staging[PL_REWIND_STAGING_BUFFERS];
+  struct rewind_journal *journal; /* Evicted snapshots, if enabled */
+  pl_rewind_counters counters;
   int (*save_state)(void *);
   int (*load_state)(void *);
   int (*get_state_size)();
 } pl_rewind;
 
+typedef struct
+{
+  int slot_count;  /* Slot capacity */
+  int slots_used;
+  int bytes_total; /* Size of the whole arena */
+  int bytes_used;  /* Snapshot data currently stored */
+  int ring_size;   /* Portion of the arena reserved for snapshot data */
+  int page_count;  /* Capacity of the page store */
+  int pages_used;
+  int journal_slots; /* Snapshots in the journal */
+  int journal_bytes; /* Size of the journal file */
+} pl_rewind_info;
+
+typedef struct
+{
+  uint64_t timestamp;      /* Tick at which the stats were taken */
+  float seconds;           /* Time covered by the counters */
+  int saves;
+  float save_avg_ms;
+  float save_max_ms;
+  int restores;            /* Includes seeks */
+  float restore_avg_ms;
+  float restore_max_ms;
+  float bytes_per_slot;    /* Average size of a stored snapshot */
+  float compression_ratio; /* Raw size over compressed size */
+  int slots_used;
+  int slot_count;
+} pl_rewind_stats;
+
 int  pl_rewind_init(pl_rewind *rewind,
   int (*save_state)(void *),
   int (*load_state)(void *),
   int (*get_state_size)());
+int  pl_rewind_init_budget(pl_rewind *rewind,
+  int (*save_state)(void *),
+  int (*load_state)(void *),
+  int (*get_state_size)(),
+  int memory_budget);
+int  pl_rewind_init_frames(pl_rewind *rewind,
+  int (*save_state)(void *),
+  int (*load_state)(void *),
+  int (*get_state_size)(),
+  int frames);
+int  pl_rewind_set_async(pl_rewind *rewind,
+                         int async);
+int  pl_rewind_set_journal(pl_rewind *rewind,
+                           const char *path);
+void pl_rewind_get_info(pl_rewind *rewind,
+                        pl_rewind_info *info);
+void pl_rewind_get_stats(pl_rewind *rewind,
+                         pl_rewind_stats *stats);
+void pl_rewind_reset_stats(pl_rewind *rewind);
 void pl_rewind_realloc(pl_rewind *rewind);
 void pl_rewind_destroy(pl_rewind *rewind);
 void pl_rewind_reset(pl_rewind *rewind);
 int  pl_rewind_save(pl_rewind *rewind);
 int  pl_rewind_restore(pl_rewind *rewind);
+int  pl_rewind_seek(pl_rewind *rewind,
+                    int frames_back);
+int  pl_rewind_get_available(pl_rewind *rewind);
 
 #ifdef __cplusplus
 }
@@ -29,6 +29,25 @@ extern "C" {
 #define PL_SND_ALIGN_SAMPLE(s) (((s) + 63) & ~63)
 #define PL_SND_TRUNCATE_SAMPLE(s) ((s) & ~63)
 
+/* Sources mixed into each channel. Voice 0 is the one used by */
+/* pl_snd_set_callback() and pl_snd_write()                    */
+#define PL_SND_VOICES 8
+/* Initial rate of the port; voices at other rates are resampled */
+#define PL_SND_OUTPUT_RATE 48000
+/* Largest adjustment made by rate control (+/- 0.5%) */
+#define PL_SND_MAX_SKEW 0.005f
+/* Range of output buffers per channel */
+#define PL_SND_MIN_BUFFERS 2
+#define PL_SND_MAX_BUFFERS 8
+/* Queue fill levels kept by pl_snd_get_stats() */
+#define PL_SND_FILL_HISTORY 64
+
+/* Input formats for pl_snd_write_voice_format(); samples are */
+/* interleaved if stereo, and dithered down to 16 bits        */
+#define PL_SND_FORMAT_S16 0
+#define PL_SND_FORMAT_S32 1 /* Full-scale 32-bit */
+#define PL_SND_FORMAT_F32 2 /* -1.0 - 1.0 */
+
 typedef struct pl_snd_stereo_sample_t
 {
   short l;
@@ -46,6 +65,22 @@ typedef union pl_snd_sample_t
   pl_snd_mono_sample mono;
 } pl_snd_sample;
 
+typedef struct pl_snd_stats_t
+{
+  unsigned int buffers;      /* Buffers played */
+  unsigned int underruns;    /* Buffers padded because a queue ran dry */
+  unsigned int late_buffers; /* Took longer to render than to play */
+  unsigned int overruns;     /* Writes that didn't fit in the queue */
+  float render_min_ms;       /* Time spent in callbacks and mixing */
+  float render_avg_ms;
+  float render_max_ms;
+  float blocked_avg_ms;      /* Time spent waiting on the port */
+  float blocked_max_ms;
+  /* Voice 0 queue fill (in samples) at each buffer, oldest first */
+  unsigned int fill[PL_SND_FILL_HISTORY];
+  int fill_count;
+} pl_snd_stats;
+
 typedef void (*pl_snd_callback)(pl_snd_sample *buffer,
                                 unsigned int samples,
                                 void *user_data);
@@ -57,6 +92,57 @@ int  pl_snd_set_callback(int channel,
                          void *userdata);
 int  pl_snd_pause(int channel);
 int  pl_snd_resume(int channel);
+int  pl_snd_set_volume(int channel,
+                       int left,
+                       int right);
+int  pl_snd_fade(int channel,
+                 float gain,
+                 int duration_ms);
+unsigned int pl_snd_write(int channel,
+                          const pl_snd_sample *samples,
+                          unsigned int count);
+unsigned int pl_snd_get_queued(int channel);
+unsigned int pl_snd_get_queue_size(int channel);
+int  pl_snd_set_voice_callback(int channel,
+                               int voice,
+                               pl_snd_callback callback,
+                               void *userdata);
+unsigned int pl_snd_write_voice(int channel,
+                                int voice,
+                                const pl_snd_sample *samples,
+                                unsigned int count);
+unsigned int pl_snd_write_voice_format(int channel,
+                                       int voice,
+                                       const void *samples,
+                                       unsigned int count,
+                                       int format,
+                                       int stereo);
+unsigned int pl_snd_get_voice_queued(int channel,
+                                     int voice);
+int  pl_snd_set_voice_gain(int channel,
+                           int voice,
+                           float gain,
+                           float pan);
+int  pl_snd_set_voice_rate(int channel,
+                           int voice,
+                           int rate,
+                           int mode);
+int  pl_snd_set_rate_control(int channel,
+                             int voice,
+                             int latency_ms);
+int  pl_snd_set_buffering(int buffer_count,
+                          int latency_ms);
+int  pl_snd_reconfigure(int samples,
+                        int stereo,
+                        int rate);
+float pl_snd_get_latency(int channel);
+int  pl_snd_get_stats(int channel,
+                      pl_snd_stats *stats);
+int  pl_snd_reset_stats(int channel);
+int  pl_snd_start_capture(int channel,
+                          const char *path);
+int  pl_snd_stop_capture(int channel);
+unsigned int pl_snd_get_capture_dropped(int channel);
 void pl_snd_shutdown();
 
 #ifdef __cplusplus
@@ -0,0 +1,96 @@
+/* psplib/pl_snd_backend.h
+   Audio output backends for pl_snd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PL_SND_BACKEND_H
+#define _PL_SND_BACKEND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Ports a backend can have open at once */
+#define PL_SND_BACKEND_PORTS 8
+
+/* Calls mirror sceAudioOut*; negative return values are errors.  */
+/* Ports are opened, written and released by the audio thread(s). */
+typedef struct pl_snd_backend_t
+{
+  /* Returns a port handle */
+  int  (*open)(void *data,
+               int samples,
+               int rate,
+               int stereo);
+  void (*release)(void *data,
+                  int port);
+  /* Blocks until buf can be queued; buf == NULL waits until */
+  /* everything queued has played                            */
+  int  (*output)(void *data,
+                 int port,
+                 const void *buf);
+  /* 0 - 0x8000 */
+  int  (*set_volume)(void *data,
+                     int port,
+                     int left,
+                     int right);
+  /* Arguments < 0 are left unchanged */
+  int  (*set_config)(void *data,
+                     int port,
+                     int samples,
+                     int rate,
+                     int stereo);
+  /* Samples queued but not yet played */
+  int  (*get_rest)(void *data,
+                   int port);
+  void *data;
+} pl_snd_backend;
+
+/* Records everything played to a 16-bit PCM .wav file */
+typedef struct pl_snd_wav_backend_t
+{
+  pl_snd_backend backend;
+  char *path;
+  void *file;
+  unsigned int data_bytes;
+  int samples;
+  int rate;
+  int stereo;
+  int paced; /* If set, output is held to real time */
+  unsigned long long start;
+  unsigned long long queued;
+} pl_snd_wav_backend;
+
+#ifdef __vita__
+/* sceAudioOut*; the default on the Vita */
+extern const pl_snd_backend pl_snd_sce_backend;
+#endif
+/* Discards output, blocking as long as real hardware would; */
+/* the default elsewhere                                     */
+extern const pl_snd_backend pl_snd_null_backend;
+
+int  pl_snd_wav_backend_init(pl_snd_wav_backend *wav,
+                             const char *path,
+                             int paced);
+void pl_snd_wav_backend_destroy(pl_snd_wav_backend *wav);
+
+/* Must be called before pl_snd_init(); NULL restores the default */
+int  pl_snd_set_backend(const pl_snd_backend *backend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PL_SND_BACKEND_H
@@ -35,6 +35,15 @@ int pl_util_save_image_seq(const char *path,
                            const PspImage *image);
 int pl_util_save_vram_seq(const char *path,
                           const char *prefix);
+int pl_util_save_image_seq_async(const char *path,
+                                 const char *filename,
+                                 const PspImage *image,
+                                 PspImageSaveCallback callback,
+                                 void *param);
+int pl_util_save_vram_seq_async(const char *path,
+                                const char *prefix,
+                                PspImageSaveCallback callback,
+                                void *param);
 int pl_util_date_compare(const SceDateTime *date1,
                          const SceDateTime *date2);
 int pl_util_compute_crc32_buffer(const void *buf,
@@ -21,15 +21,71 @@
 
 #include <malloc.h>
 #include <string.h>
+#include <setjmp.h>
 #include <png.h>
 #include <psp2/types.h>
 #include <psp2/io/fcntl.h>
+#include <psp2/kernel/threadmgr.h>
 
 #include "video.h"
 #include "image.h"
+#include "pl_pixconv.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PL_IMAGE_NEON
+#include <arm_neon.h>
+#endif
 
 typedef unsigned char byte;
 
+/* Quarter-turn rotations are done in square tiles, so that both the */
+/* rows read and the columns written stay in cache                   */
+#define ROTATE_TILE 8
+
+#define SAVE_QUEUE_LEN 4
+
+typedef struct
+{
+  FILE *fp;
+  unsigned char *bitmap;
+  int width;
+  int height;
+  int level;
+  int filters;
+  PspImageSaveCallback callback;
+  void *param;
+  char path[1024];
+} save_job;
+
+static save_job save_queue[SAVE_QUEUE_LEN];
+static int save_thread = -1;
+static int save_staged_sema; /* Jobs waiting to be written */
+static int save_free_sema;   /* Queue slots available */
+static int save_in;
+static int save_out;
+static volatile int save_stop;
+static int png_level = PSP_IMAGE_PNG_LEVEL_DEFAULT;
+static int png_filters = PSP_IMAGE_PNG_FILTER_DEFAULT;
+
+static void rotate_quarter(const PspImage *orig, PspImage *final, int angle_cw);
+static void rotate_half(const PspImage *orig, PspImage *final);
+static void rotate_tile_8(unsigned char *dest, int di, int dj,
+                          const unsigned char *src, int pitch,
+                          int rows, int cols);
+static void rotate_tile_16(unsigned short *dest, int di, int dj,
+                           const unsigned short *src, int pitch,
+                           int rows, int cols);
+
+static int start_save_thread();
+static int save_worker(SceSize args, void *argp);
+static unsigned char* create_rgb_bitmap(const PspImage *image);
+static int write_png(FILE *fp,
+                     const unsigned char *bitmap,
+                     int width,
+                     int height,
+                     int level,
+                     int filters);
+
 int FindPowerOfTwoLargerThan(int n);
 int FindPowerOfTwoLargerThan2(int n);
 
@@ -55,8 +111,8 @@ PspImage* pspImageCreateVram(int width, int height, int bpp)
     case PSP_IMAGE_INDEXED:
       framebufferTex = vita2d_create_empty_texture_format(width, height, GU_PSM_T8);
       image->Palette = vita2d_texture_get_palette(framebufferTex);
-      memset(image->Palette, 0, image->PalSize);
       image->PalSize = (unsigned short)256;
+      memset(image->Palette, 0, sizeof(uint32_t) * image->PalSize);
       image->TextureFormat = GU_PSM_T8;
       size = width * height * (bpp / 8);
       break;
@@ -142,54 +198,186 @@ PspImage* pspImageRotate(const PspImage *orig, int angle_cw)
     return NULL;
   }
 
-  int i, j, k, di = 0;
-  int width = final->Width;
-  int height = final->Height;
-  int l_shift = orig->BytesPerPixel >> 1;
+  if (!final)
+    return NULL;
 
-  const unsigned char *source = (unsigned char*)orig->Pixels;
-  unsigned char *dest = (unsigned char*)final->Pixels;
+  /* Copy image contents */
+  if (angle_cw == 180)
+    rotate_half(orig, final);
+  else
+    rotate_quarter(orig, final, angle_cw);
 
-  /* Skip to Y viewport starting point */
-  source += (orig->Viewport.Y * orig->Width) << l_shift;
+  if (orig->Depth == PSP_IMAGE_INDEXED)
+  {
+    memcpy(final->Palette, orig->Palette, sizeof(uint32_t)*orig->PalSize);
+    final->PalSize = orig->PalSize;
+  }
 
-  /* Copy image contents */
-  for (i = 0, k = 0; i < orig->Viewport.Height; i++)
+  return final;
+}
+
+/* Rotates the viewport by 90 or 270 degrees clockwise. Source pixel */
+/* (x, y) lands at origin + y * di + x * dj in the destination       */
+static void rotate_quarter(const PspImage *orig, PspImage *final, int angle_cw)
+{
+  int x, y, rows, cols, di, dj, origin, offset;
+  int width = orig->Viewport.Width;
+  int height = orig->Viewport.Height;
+  int pitch = orig->Width;
+  int first = orig->Viewport.Y * pitch + orig->Viewport.X;
+
+  if (angle_cw == 90)
+  {
+    /* Source rows become columns, from right to left */
+    origin = final->Width - 1;
+    di = -1;
+    dj = final->Width;
+  }
+  else
   {
-    /* Skip to the start of the X viewport */
-    source += orig->Viewport.X << l_shift;
+    /* Source rows become columns, read from the bottom up */
+    origin = (final->Height - 1) * final->Width;
+    di = 1;
+    dj = -final->Width;
+  }
 
-    for (j = 0; j < orig->Viewport.Width; j++, source += 1 << l_shift, k++)
+  for (y = 0; y < height; y += ROTATE_TILE)
+  {
+    rows = (height - y < ROTATE_TILE) ? height - y : ROTATE_TILE;
+    for (x = 0; x < width; x += ROTATE_TILE)
     {
-      switch(angle_cw)
-      {
-      case 90:
-        di = (width - (k / height) - 1) + (k % height) * width;
-        break;
-      case 180:
-        di = (height - i - 1) * width + (width - j - 1);
-        break;
-      case 270:
-        di = (k / height) + (height - (k % height) - 1) * width;
-        break;
-      }
-
-      /* Write to destination */
-      if (orig->Depth == PSP_IMAGE_INDEXED) dest[di] = *source;
-      else ((unsigned short*)dest)[di] = *(unsigned short*)source; /* 16 bpp */
+      cols = (width - x < ROTATE_TILE) ? width - x : ROTATE_TILE;
+      offset = origin + y * di + x * dj;
+
+      if (orig->Depth == PSP_IMAGE_INDEXED)
+        rotate_tile_8((unsigned char*)final->Pixels + offset, di, dj,
+                      (const unsigned char*)orig->Pixels + first
+                        + y * pitch + x,
+                      pitch, rows, cols);
+      else
+        rotate_tile_16((unsigned short*)final->Pixels + offset, di, dj,
+                       (const unsigned short*)orig->Pixels + first
+                         + y * pitch + x,
+                       pitch, rows, cols);
     }
-
-    /* Skip to the end of the line */
-    source += (orig->Width - (orig->Viewport.X + orig->Viewport.Width)) << l_shift;
   }
+}
 
-  if (orig->Depth == PSP_IMAGE_INDEXED)
+static void rotate_tile_8(unsigned char *dest, int di, int dj,
+                          const unsigned char *src, int pitch,
+                          int rows, int cols)
+{
+  int i, j;
+  unsigned char *d;
+  const unsigned char *s;
+
+  /* Column by column, so that writes are sequential */
+  for (j = 0; j < cols; j++, dest += dj)
+    for (i = 0, d = dest, s = src + j; i < rows; i++, d += di, s += pitch)
+      *d = *s;
+}
+
+static void rotate_tile_16(unsigned short *dest, int di, int dj,
+                           const unsigned short *src, int pitch,
+                           int rows, int cols)
+{
+  int i, j;
+  unsigned short *d;
+  const unsigned short *s;
+
+#ifdef PL_IMAGE_NEON
+  if (rows == 8 && cols == 8)
   {
-    memcpy(final->Palette, orig->Palette, sizeof(uint32_t)*orig->PalSize);
-    final->PalSize = orig->PalSize;
+    uint16x8_t r[8];
+    uint16x8x2_t t01, t23, t45, t67;
+    uint32x4x2_t u02, u13, u46, u57;
+
+    /* Load rows in destination order, so that each transposed */
+    /* column can be stored as is                              */
+    for (i = 0; i < 8; i++)
+      r[(di > 0) ? i : 7 - i] = vld1q_u16(src + i * pitch);
+    if (di < 0)
+      dest -= 7;
+
+    /* Transpose 2x2 pixel blocks, then 2x2 blocks of pairs */
+    t01 = vtrnq_u16(r[0], r[1]);
+    t23 = vtrnq_u16(r[2], r[3]);
+    t45 = vtrnq_u16(r[4], r[5]);
+    t67 = vtrnq_u16(r[6], r[7]);
+    u02 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[0]),
+                    vreinterpretq_u32_u16(t23.val[0]));
+    u13 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[1]),
+                    vreinterpretq_u32_u16(t23.val[1]));
+    u46 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[0]),
+                    vreinterpretq_u32_u16(t67.val[0]));
+    u57 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[1]),
+                    vreinterpretq_u32_u16(t67.val[1]));
+
+    /* Halves of the top and bottom four rows make up each column */
+#define STORE_COLUMNS(lo, hi, u, v) \
+    vst1q_u16(dest + (lo) * dj, \
+              vcombine_u16(vget_low_u16(vreinterpretq_u16_u32(u)), \
+                           vget_low_u16(vreinterpretq_u16_u32(v)))); \
+    vst1q_u16(dest + (hi) * dj, \
+              vcombine_u16(vget_high_u16(vreinterpretq_u16_u32(u)), \
+                           vget_high_u16(vreinterpretq_u16_u32(v))));
+
+    STORE_COLUMNS(0, 4, u02.val[0], u46.val[0])
+    STORE_COLUMNS(1, 5, u13.val[0], u57.val[0])
+    STORE_COLUMNS(2, 6, u02.val[1], u46.val[1])
+    STORE_COLUMNS(3, 7, u13.val[1], u57.val[1])
+#undef STORE_COLUMNS
+
+    return;
   }
+#endif
 
-  return final;
+  /* Column by column, so that writes are sequential */
+  for (j = 0; j < cols; j++, dest += dj)
+    for (i = 0, d = dest, s = src + j; i < rows; i++, d += di, s += pitch)
+      *d = *s;
+}
+
+/* Rotates the viewport by 180 degrees; each row is reversed */
+/* into the mirrored row of the destination                  */
+static void rotate_half(const PspImage *orig, PspImage *final)
+{
+  int x, y;
+  int width = orig->Viewport.Width;
+  int height = orig->Viewport.Height;
+  int first = orig->Viewport.Y * orig->Width + orig->Viewport.X;
+
+  for (y = 0; y < height; y++)
+  {
+    int src_line = first + y * orig->Width;
+    int dest_end = (final->Height - y) * final->Width;
+
+    if (orig->Depth == PSP_IMAGE_INDEXED)
+    {
+      const unsigned char *s = (const unsigned char*)orig->Pixels + src_line;
+      unsigned char *d = (unsigned char*)final->Pixels + dest_end;
+
+      for (x = 0; x < width; x++)
+        *--d = *s++;
+    }
+    else
+    {
+      const unsigned short *s = (const unsigned short*)orig->Pixels + src_line;
+      unsigned short *d = (unsigned short*)final->Pixels + dest_end;
+
+      x = 0;
+#ifdef PL_IMAGE_NEON
+      for (; x + 8 <= width; x += 8, s += 8)
+      {
+        uint16x8_t v = vrev64q_u16(vld1q_u16(s));
+        d -= 8;
+        vst1q_u16(d, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+      }
+#endif
+      for (; x < width; x++)
+        *--d = *s++;
+    }
+  }
 }
 
 /* Creates a half-sized thumbnail of an image */
@@ -383,9 +571,7 @@ int pspImageSavePng(const char *path, const PspImage* image)
   return stat;
 }
 
-#define IRGB(r,g,b,a)   (((((b)>>3)&0x1F)<<10)|((((g)>>3)&0x1F)<<5)|\
-  (((r)>>3)&0x1F)|(a?0x8000:0))
-
+static PspImage* load_png(png_structp png, png_infop info);
 
   void user_read_fn(png_structp pngPtr, png_bytep data, png_size_t length) {
       //Here we get our IO pointer back from the read struct.
@@ -393,7 +579,8 @@ int pspImageSavePng(const char *path, const PspImage* image)
       //Our std::istream pointer.
       png_voidp a = png_get_io_ptr(pngPtr);
       //Cast the pointer to std::istream* and read 'length' bytes into 'data'
-      sceIoRead(*(SceUID*)a,data,length);
+      if (sceIoRead(*(SceUID*)a,data,length) != length)
+        png_error(pngPtr, "Read Error");
 
   }
 
@@ -420,198 +607,301 @@ PspImage* pspImageLoadPngSCE(SceUID fp)
     return 0;
   }
 
-
-  //png_init_io(pPngStruct, fp);
-
   png_set_read_fn(pPngStruct, (png_voidp)&fp, user_read_fn);
+  png_set_sig_bytes(pPngStruct, nSigSize);
 
+  PspImage *image = load_png(pPngStruct, pPngInfo);
+  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
 
-  png_set_sig_bytes(pPngStruct, nSigSize);
-  png_read_png(pPngStruct, pPngInfo,
-    PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING |
-    PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_BGR , NULL);
+  return image;
+}
 
-  png_uint_32 width            = png_get_image_width(pPngStruct, pPngInfo);
-  png_uint_32 height = png_get_image_height(pPngStruct, pPngInfo);
-  int color_type = png_get_color_type(pPngStruct, pPngInfo);
+/* Loads an image from an open file descriptor (16-bit PNG)*/
+PspImage* pspImageLoadPngFd(FILE *fp)
+{
+  const size_t nSigSize = 8;
+  byte signature[nSigSize];
 
-  PspImage *image;
+  if (fread(signature,1,nSigSize,fp) != nSigSize)
+    return 0;
 
+  if (!png_check_sig(signature, nSigSize))
+    return 0;
 
-  if (!(image = pspImageCreate(width, height, PSP_IMAGE_16BPP)))
+  png_structp pPngStruct = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if(!pPngStruct)
+    return 0;
+
+  png_infop pPngInfo = png_create_info_struct(pPngStruct);
+  if(!pPngInfo)
   {
-    png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+    png_destroy_read_struct(&pPngStruct, NULL, NULL);
     return 0;
   }
 
-  image->Viewport.Width = width;
+  png_init_io(pPngStruct, fp);
+  png_set_sig_bytes(pPngStruct, nSigSize);
 
-  png_bytep * pRowTable;
+  PspImage *image = load_png(pPngStruct, pPngInfo);
+  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
 
-  unsigned int x, y;
+  return image;
+}
 
-  pRowTable = png_get_rows(pPngStruct, pPngInfo);
+/* Decodes the rest of a PNG (signature already read) into a new */
+/* 16bpp image. Rows are converted as they're decoded, so only   */
+/* one row of decoded data is held at a time; interlaced images  */
+/* still have to be decoded in full before conversion            */
+static PspImage* load_png(png_structp png, png_infop info)
+{
+  PspImage *volatile image = NULL;
+  png_bytep volatile rows = NULL;
+  png_bytep *volatile row_table = NULL;
+  pl_pixconv_func convert;
+  int source;
+  png_uint_32 width, height, y;
+  png_size_t row_bytes;
+  unsigned short *out;
+  int passes;
+
+  /* libpng errors land here */
+  if (setjmp(png_jmpbuf(png)))
+    goto error;
+
+  png_read_info(png, info);
+  png_set_strip_16(png);
+  png_set_packing(png);
+  png_set_expand(png);
+  png_set_bgr(png);
+  passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  width = png_get_image_width(png, info);
+  height = png_get_image_height(png, info);
+  row_bytes = png_get_rowbytes(png, info);
+
+  switch (png_get_color_type(png, info))
+  {
+  case PNG_COLOR_TYPE_GRAY:       source = PL_PIXCONV_GRAY; break;
+  case PNG_COLOR_TYPE_GRAY_ALPHA: source = PL_PIXCONV_GRAY_ALPHA; break;
+  case PNG_COLOR_TYPE_RGB:        source = PL_PIXCONV_BGR; break;
+  case PNG_COLOR_TYPE_RGB_ALPHA:  source = PL_PIXCONV_BGRA; break;
+  default: goto error;
+  }
 
-  byte r, g, b, a;
-  unsigned short *out = image->Pixels;
+  /* Any non-zero alpha is opaque */
+  convert = pl_pixconv_get(source, PL_PIXCONV_5551_KEY);
 
-  for (y=0; y<height; y++)
+  if (!(image = pspImageCreate(width, height, PSP_IMAGE_16BPP)))
+    goto error;
+
+  image->Viewport.Width = width;
+  out = image->Pixels;
+
+  if (passes == 1)
   {
-    png_byte *pRow = pRowTable[y];
-    for (x=0; x<width; x++,out++)
-    {
-      switch(color_type)
-      {
-        case PNG_COLOR_TYPE_GRAY:
-          r = g = b = *pRow++;
-          a = 1;
-          break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-          r = g = b = pRow[0];
-          a = pRow[1];
-          pRow += 2;
-          break;
-        case PNG_COLOR_TYPE_RGB:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = 1;
-          pRow += 3;
-          break;
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = pRow[3];
-          pRow += 4;
-          break;
-        default:
-          r = g = b = a = 0;
-          break;
-      }
+    if (!(rows = (png_bytep)malloc(row_bytes)))
+      goto error;
 
-//      *out++ = IRGB(r,g,b,a);
-        *out = IRGB(r,g,b,a);
+    for (y = 0; y < height; y++, out += width)
+    {
+      png_read_row(png, rows, NULL);
+      convert(out, rows, width);
     }
-
-    //out += (mod_width - width);
   }
+  else
+  {
+    /* Each pass refines rows decoded by the previous ones */
+    if (!(rows = (png_bytep)malloc(row_bytes * height)) ||
+        !(row_table = (png_bytep*)malloc(height * sizeof(png_bytep))))
+      goto error;
 
-  //png_read_end(pPngStruct, pPngInfo);
-  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+    for (y = 0; y < height; y++)
+      row_table[y] = rows + y * row_bytes;
 
+    png_read_image(png, row_table);
 
+    for (y = 0; y < height; y++, out += width)
+      convert(out, row_table[y], width);
+  }
+
+  png_read_end(png, NULL);
+
+  free(row_table);
+  free(rows);
   return image;
+
+error:
+  free(row_table);
+  free(rows);
+  if (image)
+    pspImageDestroy(image);
+  return NULL;
 }
 
-/* Loads an image from an open file descriptor (16-bit PNG)*/
-PspImage* pspImageLoadPngFd(FILE *fp)
+/* Saves an image to an open file descriptor (16-bit PNG)*/
+int pspImageSavePngFd(FILE* fp, const PspImage* image)
 {
-  const size_t nSigSize = 8;
-  byte signature[nSigSize];
+  unsigned char *bitmap;
+  int stat;
 
-  if (fread(signature,1,nSigSize,fp) != nSigSize)
+  if (!(bitmap = create_rgb_bitmap(image)))
     return 0;
 
-  if (!png_check_sig(signature, nSigSize))
-    return 0;
+  stat = write_png(fp, bitmap,
+                   image->Viewport.Width, image->Viewport.Height,
+                   png_level, png_filters);
+  free(bitmap);
 
-  png_structp pPngStruct = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if(!pPngStruct)
+  return stat;
+}
+
+/* Sets zlib level (0-9) and PNG row filters (PSP_IMAGE_PNG_FILTER_*) */
+/* for subsequent saves; _DEFAULT leaves the choice to libpng          */
+void pspImageSetPngCompression(int level, int filters)
+{
+  png_level = level;
+  png_filters = filters;
+}
+
+/* Saves an image on a background thread. The viewport is converted  */
+/* before returning, so the image may be modified or destroyed right */
+/* away. callback, if set, runs on the save thread once the file is  */
+/* closed. Must not be called from more than one thread at a time    */
+int pspImageSavePngAsync(const char *path,
+                         const PspImage* image,
+                         PspImageSaveCallback callback,
+                         void *param)
+{
+  save_job *job;
+  unsigned char *bitmap;
+  FILE *fp;
+
+  if (save_thread < 0 && !start_save_thread())
+    return 0;
+  if (!(bitmap = create_rgb_bitmap(image)))
     return 0;
 
-  png_infop pPngInfo = png_create_info_struct(pPngStruct);
-  if(!pPngInfo)
+  /* Opening here reserves the name and reports bad paths right away */
+  if (!(fp = fopen(path, "wb")))
   {
-    png_destroy_read_struct(&pPngStruct, NULL, NULL);
+    free(bitmap);
     return 0;
   }
 
+  /* Blocks only if the save thread has fallen behind */
+  sceKernelWaitSema(save_free_sema, 1, NULL);
 
-  png_init_io(pPngStruct, fp);
+  job = &save_queue[save_in];
+  job->fp = fp;
+  job->bitmap = bitmap;
+  job->width = image->Viewport.Width;
+  job->height = image->Viewport.Height;
+  job->level = png_level;
+  job->filters = png_filters;
+  job->callback = callback;
+  job->param = param;
+  strncpy(job->path, path, sizeof(job->path) - 1);
+  job->path[sizeof(job->path) - 1] = '\0';
 
+  save_in = (save_in + 1) % SAVE_QUEUE_LEN;
+  sceKernelSignalSema(save_staged_sema, 1);
 
+  return 1;
+}
 
-  png_set_sig_bytes(pPngStruct, nSigSize);
-  png_read_png(pPngStruct, pPngInfo,
-    PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING |
-    PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_BGR , NULL);
-
-  png_uint_32 width            = png_get_image_width(pPngStruct, pPngInfo);
-  png_uint_32 height = png_get_image_height(pPngStruct, pPngInfo);
-  int color_type = png_get_color_type(pPngStruct, pPngInfo);
+/* Waits until every queued save has been written */
+void pspImageFlushSaves()
+{
+  if (save_thread < 0)
+    return;
 
-  PspImage *image;
+  sceKernelWaitSema(save_free_sema, SAVE_QUEUE_LEN, NULL);
+  sceKernelSignalSema(save_free_sema, SAVE_QUEUE_LEN);
+}
 
+/* Finishes queued saves and stops the save thread */
+void pspImageShutdownSaves()
+{
+  if (save_thread < 0)
+    return;
+
+  pspImageFlushSaves();
+  save_stop = 1;
+  sceKernelSignalSema(save_staged_sema, 1);
+  sceKernelWaitThreadEnd(save_thread, NULL, NULL);
+  sceKernelDeleteThread(save_thread);
+  sceKernelDeleteSema(save_staged_sema);
+  sceKernelDeleteSema(save_free_sema);
+
+  save_thread = -1;
+}
 
-  if (!(image = pspImageCreate(width, height, PSP_IMAGE_16BPP)))
+static int start_save_thread()
+{
+  save_in = save_out = 0;
+  save_stop = 0;
+  save_staged_sema = sceKernelCreateSema("image_save_staged", 0, 0,
+                                         SAVE_QUEUE_LEN, NULL);
+  save_free_sema = sceKernelCreateSema("image_save_free", 0,
+                                       SAVE_QUEUE_LEN,
+                                       SAVE_QUEUE_LEN, NULL);
+  save_thread = sceKernelCreateThread("image_save",
+                                      save_worker,
+                                      0x10000100, 0x10000,
+                                      0, 0, NULL);
+
+  if (save_staged_sema < 0 ||
+      save_free_sema < 0 ||
+      save_thread < 0 ||
+      sceKernelStartThread(save_thread, 0, NULL) < 0)
   {
-    png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+    if (save_thread >= 0)
+      sceKernelDeleteThread(save_thread);
+    if (save_staged_sema >= 0)
+      sceKernelDeleteSema(save_staged_sema);
+    if (save_free_sema >= 0)
+      sceKernelDeleteSema(save_free_sema);
+
+    save_thread = -1;
     return 0;
   }
 
-  image->Viewport.Width = width;
-
-  png_bytep * pRowTable;
-
-  unsigned int x, y;
-
-  pRowTable = png_get_rows(pPngStruct, pPngInfo);
+  return 1;
+}
 
-  byte r, g, b, a;
-  unsigned short *out = image->Pixels;
+static int save_worker(SceSize args, void *argp)
+{
+  save_job *job;
+  int stat;
 
-  for (y=0; y<height; y++)
+  for (;;)
   {
-    png_byte *pRow = pRowTable[y];
-    for (x=0; x<width; x++,out++)
-    {
-      switch(color_type)
-      {
-        case PNG_COLOR_TYPE_GRAY:
-          r = g = b = *pRow++;
-          a = 1;
-          break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-          r = g = b = pRow[0];
-          a = pRow[1];
-          pRow += 2;
-          break;
-        case PNG_COLOR_TYPE_RGB:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = 0xff;
-          pRow += 3;
-          break;
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = pRow[3];
-          pRow += 4;
-          break;
-        default:
-          r = g = b = a = 0;
-          break;
-      }
+    sceKernelWaitSema(save_staged_sema, 1, NULL);
+    if (save_stop)
+      break;
 
-//      *out++ = IRGB(r,g,b,a);
-        *out = IRGB(r,g,b,a);
-    }
+    job = &save_queue[save_out];
+    stat = write_png(job->fp, job->bitmap,
+                     job->width, job->height,
+                     job->level, job->filters);
+    if (fclose(job->fp) != 0)
+      stat = 0;
+    free(job->bitmap);
 
-    //out += (mod_width - width);
-  }
-
-  //png_read_end(pPngStruct, pPngInfo);
-  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+    if (job->callback)
+      job->callback(job->path, stat, job->param);
 
+    save_out = (save_out + 1) % SAVE_QUEUE_LEN;
+    sceKernelSignalSema(save_free_sema, 1);
+  }
 
-  return image;
+  sceKernelExitThread(0);
+  return 0;
 }
 
-/* Saves an image to an open file descriptor (16-bit PNG)*/
-int pspImageSavePngFd(FILE* fp, const PspImage* image)
+/* Converts the viewport to a 24-bit RGB bitmap */
+static unsigned char* create_rgb_bitmap(const PspImage *image)
 {
   unsigned char *bitmap;
   int i, j, width, height;
@@ -620,8 +910,7 @@ int pspImageSavePngFd(FILE* fp, const PspImage* image)
   height = image->Viewport.Height;
 
   if (!(bitmap = (uint8_t*)malloc(sizeof(uint8_t) * width * height * 3)))
-    return 0;
-
+    return NULL;
   if (image->Depth == PSP_IMAGE_INDEXED)
   {
     const unsigned char *pixel;
@@ -661,21 +950,26 @@ int pspImageSavePngFd(FILE* fp, const PspImage* image)
     }
   }
 
+  return bitmap;
+}
+
+static int write_png(FILE *fp,
+                     const unsigned char *bitmap,
+                     int width,
+                     int height,
+                     int level,
+                     int filters)
+{
   png_struct *pPngStruct = png_create_write_struct( PNG_LIBPNG_VER_STRING,
     NULL, NULL, NULL );
 
   if (!pPngStruct)
-  {
-    free(bitmap);
     return 0;
-  }
-
 
   png_info *pPngInfo = png_create_info_struct( pPngStruct );
   if (!pPngInfo)
   {
     png_destroy_write_struct( &pPngStruct, NULL );
-    free(bitmap);
     return 0;
   }
 
@@ -683,7 +977,6 @@ int pspImageSavePngFd(FILE* fp, const PspImage* image)
   if (!buf)
   {
     png_destroy_write_struct( &pPngStruct, &pPngInfo );
-    free(bitmap);
     return 0;
   }
 
@@ -691,9 +984,20 @@ int pspImageSavePngFd(FILE* fp, const PspImage* image)
   for (y = 0; y < height; y++)
     buf[y] = (byte*)&bitmap[y * width * 3];
 
+  if (setjmp(png_jmpbuf(pPngStruct)))
+  {
+    png_destroy_write_struct( &pPngStruct, &pPngInfo );
+    free(buf);
+    return 0;
+  }
 
   png_init_io( pPngStruct, fp );
 
+  if (level != PSP_IMAGE_PNG_LEVEL_DEFAULT)
+    png_set_compression_level( pPngStruct, level );
+  if (filters != PSP_IMAGE_PNG_FILTER_DEFAULT)
+    png_set_filter( pPngStruct, PNG_FILTER_TYPE_BASE, filters );
+
   png_set_IHDR( pPngStruct, pPngInfo, width, height, 8,
     PNG_COLOR_TYPE_RGB,
     PNG_INTERLACE_NONE,
@@ -708,7 +1012,6 @@ int pspImageSavePngFd(FILE* fp, const PspImage* image)
 
   png_destroy_write_struct( &pPngStruct, &pPngInfo );
   free(buf);
-  free(bitmap);
 
   return 1;
 }
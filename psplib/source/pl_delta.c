@@ -0,0 +1,281 @@
+/* psplib/pl_delta.c
+   XOR delta encoding for state snapshots
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PL_DELTA_NEON
+#include <arm_neon.h>
+#endif
+
+#include "pl_delta.h"
+
+/* Changed runs end at the first unchanged 16-byte chunk */
+#define CHUNK_SIZE 16
+#define BLOCK_SIZE 64
+
+/* With has_base == 0, base is ignored and compared as zero. */
+/* Callers pass constants, so each variant is inlined apart  */
+
+static inline int chunk_equal(const uint8_t *base,
+                              const uint8_t *state,
+                              int has_base)
+{
+#ifdef PL_DELTA_NEON
+  uint8x16_t x = vld1q_u8(state);
+  if (has_base) x = veorq_u8(x, vld1q_u8(base));
+
+  uint32x2_t t = vreinterpret_u32_u8(vorr_u8(vget_low_u8(x),
+                                             vget_high_u8(x)));
+  t = vpmax_u32(t, t);
+  return !vget_lane_u32(t, 0);
+#else
+  uint64_t s0, s1, b0 = 0, b1 = 0;
+  memcpy(&s0, state, 8);
+  memcpy(&s1, state + 8, 8);
+  if (has_base)
+  {
+    memcpy(&b0, base, 8);
+    memcpy(&b1, base + 8, 8);
+  }
+  return !((s0 ^ b0) | (s1 ^ b1));
+#endif
+}
+
+static inline int block_equal(const uint8_t *base,
+                              const uint8_t *state,
+                              int has_base)
+{
+#ifdef PL_DELTA_NEON
+  uint8x16_t x0 = vld1q_u8(state);
+  uint8x16_t x1 = vld1q_u8(state + 16);
+  uint8x16_t x2 = vld1q_u8(state + 32);
+  uint8x16_t x3 = vld1q_u8(state + 48);
+  if (has_base)
+  {
+    x0 = veorq_u8(x0, vld1q_u8(base));
+    x1 = veorq_u8(x1, vld1q_u8(base + 16));
+    x2 = veorq_u8(x2, vld1q_u8(base + 32));
+    x3 = veorq_u8(x3, vld1q_u8(base + 48));
+  }
+
+  /* Fold to a single lane; NEON-to-core moves are expensive */
+  x0 = vorrq_u8(vorrq_u8(x0, x1), vorrq_u8(x2, x3));
+  uint32x2_t t = vreinterpret_u32_u8(vorr_u8(vget_low_u8(x0),
+                                             vget_high_u8(x0)));
+  t = vpmax_u32(t, t);
+  return !vget_lane_u32(t, 0);
+#else
+  return chunk_equal(base, state, has_base) &&
+         chunk_equal(base + 16, state + 16, has_base) &&
+         chunk_equal(base + 32, state + 32, has_base) &&
+         chunk_equal(base + 48, state + 48, has_base);
+#endif
+}
+
+static inline void xor_copy(uint8_t *out,
+                            const uint8_t *base,
+                            const uint8_t *state,
+                            int len,
+                            int has_base)
+{
+  int i = 0;
+
+  if (!has_base)
+  {
+    memcpy(out, state, len);
+    return;
+  }
+
+#ifdef PL_DELTA_NEON
+  for (; i + CHUNK_SIZE <= len; i += CHUNK_SIZE)
+    vst1q_u8(out + i, veorq_u8(vld1q_u8(state + i), vld1q_u8(base + i)));
+#else
+  uint64_t s, b;
+  for (; i + 8 <= len; i += 8)
+  {
+    memcpy(&s, state + i, 8);
+    memcpy(&b, base + i, 8);
+    s ^= b;
+    memcpy(out + i, &s, 8);
+  }
+#endif
+
+  for (; i < len; i++)
+    out[i] = state[i] ^ base[i];
+}
+
+static inline uint8_t* put_varint(uint8_t *out,
+                                  unsigned int value)
+{
+  for (; value >= 0x80; value >>= 7)
+    *out++ = (value & 0x7f) | 0x80;
+  *out++ = value;
+  return out;
+}
+
+/* Returns NULL if the value is cut off, or longer than the */
+/* five bytes put_varint() writes for 32 bits               */
+static inline const uint8_t* get_varint(const uint8_t *in,
+                                        const uint8_t *end,
+                                        unsigned int *value)
+{
+  int shift;
+  for (*value = 0, shift = 0; in < end && shift <= 28; in++, shift += 7)
+  {
+    *value |= (unsigned int)(*in & 0x7f) << shift;
+    if (!(*in & 0x80))
+      return in + 1;
+  }
+  return NULL;
+}
+
+static inline int encode(const uint8_t *base,
+                         const uint8_t *state,
+                         int size,
+                         uint8_t *out,
+                         int out_max,
+                         int has_base)
+{
+#define SAME(i) (state[i] == ((has_base) ? base[i] : 0))
+  uint8_t *op = out, *end = out + out_max;
+  int pos = 0, zero_start, lit_start, lit_end;
+
+  while (pos < size)
+  {
+    /* Skip unchanged bytes */
+    zero_start = pos;
+    while (pos + BLOCK_SIZE <= size &&
+           block_equal(base + pos, state + pos, has_base))
+      pos += BLOCK_SIZE;
+    while (pos + CHUNK_SIZE <= size &&
+           chunk_equal(base + pos, state + pos, has_base))
+      pos += CHUNK_SIZE;
+    while (pos < size && SAME(pos))
+      pos++;
+
+    if (pos >= size)
+      break;
+
+    /* Extend the changed run up to the next unchanged chunk */
+    lit_start = pos;
+    while (pos + CHUNK_SIZE <= size &&
+           !chunk_equal(base + pos, state + pos, has_base))
+      pos += CHUNK_SIZE;
+    if (pos + CHUNK_SIZE > size)
+      pos = size;
+
+    /* Trim unchanged bytes off its end */
+    for (lit_end = pos; SAME(lit_end - 1); lit_end--);
+
+    if (end - op < 10 + (lit_end - lit_start))
+      return -1;
+
+    op = put_varint(op, lit_start - zero_start);
+    op = put_varint(op, lit_end - lit_start);
+    xor_copy(op, base + lit_start, state + lit_start,
+             lit_end - lit_start, has_base);
+    op += lit_end - lit_start;
+
+    pos = lit_end;
+  }
+
+  return op - out;
+#undef SAME
+}
+
+int pl_delta_encode(const void *base,
+                    const void *state,
+                    int size,
+                    void *out,
+                    int out_max)
+{
+  if (base)
+    return encode((const uint8_t*)base, (const uint8_t*)state,
+                  size, (uint8_t*)out, out_max, 1);
+  else
+    return encode((const uint8_t*)state, (const uint8_t*)state,
+                  size, (uint8_t*)out, out_max, 0);
+}
+
+int pl_delta_apply(void *state,
+                   int size,
+                   const void *delta,
+                   int delta_len)
+{
+  const uint8_t *in = (const uint8_t*)delta;
+  const uint8_t *end = in + delta_len;
+  uint8_t *dest = (uint8_t*)state;
+  unsigned int pos = 0, count;
+
+  if (size < 0)
+    return 0;
+
+  /* Compared as remaining space, so that no sum can wrap */
+  while (in < end)
+  {
+    if (!(in = get_varint(in, end, &count)) || count > size - pos)
+      return 0;
+    pos += count;
+
+    if (!(in = get_varint(in, end, &count)) || count > size - pos ||
+        count > end - in)
+      return 0;
+
+    pl_delta_xor(dest + pos, in, count);
+    pos += count;
+    in += count;
+  }
+
+  return 1;
+}
+
+void pl_delta_xor(void *dest,
+                  const void *src,
+                  int size)
+{
+  uint8_t *d = (uint8_t*)dest;
+  const uint8_t *s = (const uint8_t*)src;
+  int i = 0;
+
+#ifdef PL_DELTA_NEON
+  for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE)
+  {
+    uint8x16_t d0 = vld1q_u8(d + i), d1 = vld1q_u8(d + i + 16);
+    uint8x16_t d2 = vld1q_u8(d + i + 32), d3 = vld1q_u8(d + i + 48);
+    vst1q_u8(d + i, veorq_u8(d0, vld1q_u8(s + i)));
+    vst1q_u8(d + i + 16, veorq_u8(d1, vld1q_u8(s + i + 16)));
+    vst1q_u8(d + i + 32, veorq_u8(d2, vld1q_u8(s + i + 32)));
+    vst1q_u8(d + i + 48, veorq_u8(d3, vld1q_u8(s + i + 48)));
+  }
+  for (; i + CHUNK_SIZE <= size; i += CHUNK_SIZE)
+    vst1q_u8(d + i, veorq_u8(vld1q_u8(d + i), vld1q_u8(s + i)));
+#else
+  uint64_t a, b;
+  for (; i + 8 <= size; i += 8)
+  {
+    memcpy(&a, d + i, 8);
+    memcpy(&b, s + i, 8);
+    a ^= b;
+    memcpy(d + i, &a, 8);
+  }
+#endif
+
+  for (; i < size; i++)
+    d[i] ^= s[i];
+}
@@ -0,0 +1,260 @@
+/* psplib/pl_dsp.c
+   Audio sample processing kernels
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PL_DSP_NEON
+#include <arm_neon.h>
+#endif
+
+#include "pl_dsp.h"
+
+static inline short saturate_s16(int32_t sample)
+{
+  if (sample > 32767) return 32767;
+  if (sample < -32768) return -32768;
+  return (short)sample;
+}
+
+void pl_dsp_mix_s16(short *dest,
+                    const short *src,
+                    unsigned int count,
+                    short gain_l,
+                    short gain_r)
+{
+  unsigned int i = 0;
+
+#ifdef PL_DSP_NEON
+  /* Gains alternate to match interleaved L/R samples */
+  const int16_t gains[4] = { gain_l, gain_r, gain_l, gain_r };
+  int16x8_t gain = vcombine_s16(vld1_s16(gains), vld1_s16(gains));
+
+  for (; i + 16 <= count; i += 16)
+  {
+    int16x8_t a0 = vld1q_s16(dest + i);
+    int16x8_t a1 = vld1q_s16(dest + i + 8);
+    int16x8_t b0 = vld1q_s16(src + i);
+    int16x8_t b1 = vld1q_s16(src + i + 8);
+
+    /* vqdmulh yields (b * gain * 2) >> 16, i.e. Q15 scaling */
+    a0 = vqaddq_s16(a0, vqdmulhq_s16(b0, gain));
+    a1 = vqaddq_s16(a1, vqdmulhq_s16(b1, gain));
+
+    vst1q_s16(dest + i, a0);
+    vst1q_s16(dest + i + 8, a1);
+  }
+#endif
+
+  /* Scalar path matches vqdmulh rounding (truncation) */
+  for (; i + 2 <= count; i += 2)
+  {
+    dest[i] = saturate_s16(dest[i] + ((src[i] * gain_l) >> 15));
+    dest[i + 1] = saturate_s16(dest[i + 1] + ((src[i + 1] * gain_r) >> 15));
+  }
+  if (i < count)
+    dest[i] = saturate_s16(dest[i] + ((src[i] * gain_l) >> 15));
+}
+
+int pl_dsp_ramp_s16(short *buf,
+                    unsigned int frames,
+                    int channels,
+                    int gain,
+                    int step)
+{
+  unsigned int i;
+  int32_t g;
+
+  if (channels == 2)
+  {
+    for (i = 0; i < frames; i++, buf += 2, gain += step)
+    {
+      g = gain >> 15; /* Q15; unity fits since the product is 32-bit */
+      buf[0] = (short)((buf[0] * g) >> 15);
+      buf[1] = (short)((buf[1] * g) >> 15);
+    }
+  }
+  else
+  {
+    for (i = 0; i < frames; i++, gain += step)
+      buf[i] = (short)((buf[i] * (gain >> 15)) >> 15);
+  }
+
+  return gain;
+}
+
+/* Numerical Recipes LCG; only the high bits are used */
+#define DITHER_MUL 1664525u
+#define DITHER_ADD 1013904223u
+
+/* Two uniform draws of 0 - 0xffff make a triangular +/-1 LSB */
+/* (of s16) dither, in s32 units. Includes the rounding bias  */
+static inline int32_t next_dither(uint32_t *state)
+{
+  uint32_t a, b;
+  *state = *state * DITHER_MUL + DITHER_ADD;
+  a = *state >> 16;
+  *state = *state * DITHER_MUL + DITHER_ADD;
+  b = *state >> 16;
+  return (int32_t)(a + b) - 0xffff + 0x8000;
+}
+
+static inline short s32_to_s16(int32_t sample,
+                               int32_t dither)
+{
+  return saturate_s16((int32_t)(((int64_t)sample + dither) >> 16));
+}
+
+static inline int32_t f32_to_s32(float sample)
+{
+  if (sample >= 1.0f) return INT32_MAX;
+  if (sample < -1.0f) return INT32_MIN;
+  if (sample != sample) return 0; /* NaN, as vcvt does */
+  return (int32_t)(sample * 2147483648.0f);
+}
+
+#ifdef PL_DSP_NEON
+/* Four independent generators, seeded from the caller's state */
+static inline uint32x4_t seed_lanes(uint32_t *state)
+{
+  uint32_t lanes[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    lanes[i] = *state = *state * DITHER_MUL + DITHER_ADD;
+  return vld1q_u32(lanes);
+}
+
+static inline int32x4_t next_dither_x4(uint32x4_t *state)
+{
+  const uint32x4_t mul = vdupq_n_u32(DITHER_MUL);
+  const uint32x4_t add = vdupq_n_u32(DITHER_ADD);
+  uint32x4_t a, b;
+
+  *state = vmlaq_u32(add, *state, mul);
+  a = vshrq_n_u32(*state, 16);
+  *state = vmlaq_u32(add, *state, mul);
+  b = vshrq_n_u32(*state, 16);
+
+  return vsubq_s32(vreinterpretq_s32_u32(vaddq_u32(a, b)),
+                   vdupq_n_s32(0xffff - 0x8000));
+}
+
+/* Adds dither (or just the rounding bias), saturating, and */
+/* narrows to the top 16 bits                               */
+static inline int16x4_t narrow_s32(int32x4_t sample,
+                                   uint32x4_t *state,
+                                   int dither)
+{
+  int32x4_t bias = (dither) ? next_dither_x4(state) : vdupq_n_s32(0x8000);
+  return vshrn_n_s32(vqaddq_s32(sample, bias), 16);
+}
+#endif
+
+void pl_dsp_s32_to_s16(short *dest,
+                       const int *src,
+                       unsigned int count,
+                       unsigned int *seed)
+{
+  uint32_t state = (seed) ? *seed : 0;
+  unsigned int i = 0;
+
+#ifdef PL_DSP_NEON
+  uint32x4_t lanes = (seed) ? seed_lanes(&state) : vdupq_n_u32(0);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    int16x4_t lo = narrow_s32(vld1q_s32(src + i), &lanes, seed != NULL);
+    int16x4_t hi = narrow_s32(vld1q_s32(src + i + 4), &lanes, seed != NULL);
+    vst1q_s16(dest + i, vcombine_s16(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++)
+    dest[i] = s32_to_s16(src[i], (seed) ? next_dither(&state) : 0x8000);
+
+  if (seed)
+    *seed = state;
+}
+
+void pl_dsp_f32_to_s16(short *dest,
+                       const float *src,
+                       unsigned int count,
+                       unsigned int *seed)
+{
+  uint32_t state = (seed) ? *seed : 0;
+  unsigned int i = 0;
+
+#ifdef PL_DSP_NEON
+  uint32x4_t lanes = (seed) ? seed_lanes(&state) : vdupq_n_u32(0);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    /* Fixed-point conversion saturates at +/-1.0 */
+    int32x4_t s0 = vcvtq_n_s32_f32(vld1q_f32(src + i), 31);
+    int32x4_t s1 = vcvtq_n_s32_f32(vld1q_f32(src + i + 4), 31);
+    int16x4_t lo = narrow_s32(s0, &lanes, seed != NULL);
+    int16x4_t hi = narrow_s32(s1, &lanes, seed != NULL);
+    vst1q_s16(dest + i, vcombine_s16(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++)
+    dest[i] = s32_to_s16(f32_to_s32(src[i]),
+                         (seed) ? next_dither(&state) : 0x8000);
+
+  if (seed)
+    *seed = state;
+}
+
+void pl_dsp_mono_to_stereo_s16(short *dest,
+                               const short *src,
+                               unsigned int frames)
+{
+  unsigned int i = 0;
+
+#ifdef PL_DSP_NEON
+  for (; i + 8 <= frames; i += 8)
+  {
+    int16x8x2_t pair;
+    pair.val[0] = pair.val[1] = vld1q_s16(src + i);
+    vst2q_s16(dest + i * 2, pair);
+  }
+#endif
+
+  for (; i < frames; i++)
+    dest[i * 2] = dest[i * 2 + 1] = src[i];
+}
+
+void pl_dsp_stereo_to_mono_s16(short *dest,
+                               const short *src,
+                               unsigned int frames)
+{
+  unsigned int i = 0;
+
+#ifdef PL_DSP_NEON
+  for (; i + 8 <= frames; i += 8)
+  {
+    int16x8x2_t pair = vld2q_s16(src + i * 2);
+    vst1q_s16(dest + i, vhaddq_s16(pair.val[0], pair.val[1]));
+  }
+#endif
+
+  /* vhadd truncates, like >> */
+  for (; i < frames; i++)
+    dest[i] = (short)((src[i * 2] + src[i * 2 + 1]) >> 1);
+}
@@ -21,10 +21,12 @@
 
 #include <malloc.h>
 #include <string.h>
+#include <setjmp.h>
 #include <png.h>
 
 #include "pl_image.h"
 #include "pl_file.h"
+#include "pl_pixconv.h"
 
 #ifdef PSP
 #include "pl_gfx.h"
@@ -39,6 +41,94 @@ int copy_to_void(pl_image_format format,
                  uint32_t from,
                  void *to);
 
+static int load_png(png_struct *png,
+                    png_info *info,
+                    pl_image *image,
+                    pl_image_format format);
+
+/* Row kernels. Pixel loops pick one of these once per image, based on */
+/* the image format, instead of dispatching on the format per pixel    */
+typedef void (*fill_row_func)(void *dest,
+                              uint32_t color,
+                              uint count);
+typedef void (*decimate_row_func)(void *dest,
+                                  const void *src,
+                                  uint count);
+typedef void (*split_row_func)(uint8_t *dest,
+                               const void *src,
+                               const void *palette,
+                               uint count);
+
+static fill_row_func get_fill_row(pl_image_format format);
+static decimate_row_func get_decimate_row(pl_image_format format);
+static split_row_func get_split_row(pl_image_format format,
+                                    pl_image_format pal_format);
+
+/* Generates the copy kernels for a pixel of a given storage type */
+#define PIXEL_KERNELS(type) \
+  static void fill_row_##type(void *dest, \
+                              uint32_t color, \
+                              uint count) \
+  { \
+    type *d = (type*)dest; \
+    for (; count; count--) *d++ = (type)color; \
+  } \
+  static void decimate_row_##type(void *dest, \
+                                  const void *src, \
+                                  uint count) \
+  { \
+    type *d = (type*)dest; \
+    const type *s = (const type*)src; \
+    for (; count; count--, s += 2) *d++ = *s; \
+  }
+
+/* Expand a 16-bit color to 8-bit RGB */
+#define SPLIT_4444(c, d) \
+  (d)[0] = ((c) & 0x0F) * 0xFF/0x0F; \
+  (d)[1] = (((c) >> 4) & 0x0F) * 0xFF/0x0F; \
+  (d)[2] = (((c) >> 8) & 0x0F) * 0xFF/0x0F;
+#define SPLIT_5551(c, d) \
+  (d)[0] = ((c) & 0x1F) * 0xFF/0x1F; \
+  (d)[1] = (((c) >> 5) & 0x1F) * 0xFF/0x1F; \
+  (d)[2] = (((c) >> 10) & 0x1F) * 0xFF/0x1F;
+
+/* Generates the RGB split kernels for a color format, both for direct */
+/* pixels and for indexed pixels whose palette is in that format       */
+#define SPLIT_KERNELS(format, split) \
+  static void split_row_##format(uint8_t *dest, \
+                                 const void *src, \
+                                 const void *palette, \
+                                 uint count) \
+  { \
+    const uint16_t *s = (const uint16_t*)src; \
+    uint32_t c; \
+    for (; count; count--, dest += 3) \
+    { \
+      c = *s++; \
+      split(c, dest) \
+    } \
+  } \
+  static void split_row_indexed_##format(uint8_t *dest, \
+                                         const void *src, \
+                                         const void *palette, \
+                                         uint count) \
+  { \
+    const uint8_t *s = (const uint8_t*)src; \
+    const uint16_t *pal = (const uint16_t*)palette; \
+    uint32_t c; \
+    for (; count; count--, dest += 3) \
+    { \
+      c = pal[*s++]; \
+      split(c, dest) \
+    } \
+  }
+
+PIXEL_KERNELS(uint8_t)
+PIXEL_KERNELS(uint16_t)
+PIXEL_KERNELS(uint32_t)
+SPLIT_KERNELS(4444, SPLIT_4444)
+SPLIT_KERNELS(5551, SPLIT_5551)
+
 int pl_image_create(pl_image *image,
                     uint width,
                     uint height,
@@ -282,126 +372,144 @@ int pl_image_load_png_stream(pl_image *image,
     return 0;
   }
 
-  if (png_jmpbuf(pPngStruct))
+  png_init_io(pPngStruct, stream);
+  png_set_sig_bytes(pPngStruct, nSigSize);
+
+  int status = load_png(pPngStruct, pPngInfo, image, format);
+  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+
+  return status;
+}
+
+/* Decodes the rest of a PNG (signature already read) into image. */
+/* Rows are converted as they're decoded, so only one row of      */
+/* decoded data is held at a time; interlaced images still have   */
+/* to be decoded in full before conversion                        */
+static int load_png(png_struct *png,
+                    png_info *info,
+                    pl_image *image,
+                    pl_image_format format)
+{
+  png_bytep volatile rows = NULL;
+  png_bytep *volatile row_table = NULL;
+  volatile int created = 0;
+  pl_pixconv_func convert;
+  int source, dest;
+  png_uint_32 width, height, y;
+  png_size_t row_bytes;
+  void *line_ptr;
+  int passes;
+
+  /* libpng errors land here */
+  if (setjmp(png_jmpbuf(png)))
+    goto error;
+
+  png_read_info(png, info);
+  png_set_strip_16(png);
+  png_set_packing(png);
+  png_set_expand(png);
+  png_set_bgr(png);
+  passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  width = png_get_image_width(png, info);
+  height = png_get_image_height(png, info);
+  row_bytes = png_get_rowbytes(png, info);
+
+  switch (png_get_color_type(png, info))
   {
-    png_destroy_read_struct(&pPngStruct, NULL, NULL);
-    return 0;
+  case PNG_COLOR_TYPE_GRAY:       source = PL_PIXCONV_GRAY; break;
+  case PNG_COLOR_TYPE_GRAY_ALPHA: source = PL_PIXCONV_GRAY_ALPHA; break;
+  case PNG_COLOR_TYPE_RGB:        source = PL_PIXCONV_BGR; break;
+  case PNG_COLOR_TYPE_RGB_ALPHA:  source = PL_PIXCONV_BGRA; break;
+  default: goto error;
   }
 
-  png_init_io(pPngStruct, stream);
-  png_set_sig_bytes(pPngStruct, nSigSize);
-  png_read_png(pPngStruct, pPngInfo,
-    PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING |
-    PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_BGR , NULL);
+  switch (format)
+  {
+  case pl_image_5551: dest = PL_PIXCONV_5551; break;
+  case pl_image_4444: dest = PL_PIXCONV_4444; break;
+  default: goto error;
+  }
 
-  png_uint_32 width = png_get_image_width(pPngStruct, pPngInfo);
-  png_uint_32 height = png_get_image_height(pPngStruct, pPngInfo);
-  int color_type = png_get_color_type(pPngStruct, pPngInfo);
+  convert = pl_pixconv_get(source, dest);
 
   if (!pl_image_create(image,
                        width,
                        height,
                        format,
                        0))
-  {
-    png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
-    return 0;
-  }
+    goto error;
+  created = 1;
 
-  png_bytep pRowTable[height];
-  png_read_image(pPngStruct, pRowTable);
+  line_ptr = image->bitmap;
 
-  unsigned int x, y;
-  uint8_t r, g, b, a;
-  uint32_t color;
-  int bytes_per_pixel = pl_image_get_bytes_per_pixel(format);
-  void *line_ptr, *pel_ptr;
-
-  for (y = 0, line_ptr = image->bitmap;
-       y < height;
-       y++, line_ptr += image->pitch)
+  if (passes == 1)
   {
-    png_byte *pRow = pRowTable[y];
+    if (!(rows = (png_bytep)malloc(row_bytes)))
+      goto error;
 
-    for (x = 0, pel_ptr = line_ptr;
-         x < width;
-         x++, pel_ptr += bytes_per_pixel)
+    for (y = 0; y < height; y++, line_ptr += image->pitch)
     {
-      switch(color_type)
-      {
-        case PNG_COLOR_TYPE_GRAY:
-          r = g = b = *pRow++;
-          a = 0xff;
-          break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-          r = g = b = pRow[0];
-          a = pRow[1];
-          pRow += 2;
-          break;
-        case PNG_COLOR_TYPE_RGB:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = 0xff;
-          pRow += 3;
-          break;
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-          b = pRow[0];
-          g = pRow[1];
-          r = pRow[2];
-          a = pRow[3];
-          pRow += 4;
-          break;
-        default:
-          r = g = b = a = 0;
-          break;
-      }
-
-      pl_image_compose_color(format, &color, r, g, b, a);
-      copy_to_void(format, color, pel_ptr);
+      png_read_row(png, rows, NULL);
+      convert(line_ptr, rows, width);
     }
   }
+  else
+  {
+    /* Each pass refines rows decoded by the previous ones */
+    if (!(rows = (png_bytep)malloc(row_bytes * height)) ||
+        !(row_table = (png_bytep*)malloc(height * sizeof(png_bytep))))
+      goto error;
+
+    for (y = 0; y < height; y++)
+      row_table[y] = rows + y * row_bytes;
+
+    png_read_image(png, row_table);
+
+    for (y = 0; y < height; y++, line_ptr += image->pitch)
+      convert(line_ptr, row_table[y], width);
+  }
 
-  png_destroy_read_struct(&pPngStruct, &pPngInfo, NULL);
+  png_read_end(png, NULL);
 
+  free(row_table);
+  free(rows);
   return 1;
+
+error:
+  free(row_table);
+  free(rows);
+  if (created)
+    pl_image_destroy(image);
+  return 0;
 }
 
 int pl_image_save_png_stream(const pl_image *image,
                              FILE *stream)
 {
   unsigned char *bitmap;
-  int i, j;
-  uint8_t r = 0, g = 0, b = 0, a = 0;
+  int i;
   int width = image->view.w;
   int height = image->view.h;
   int bytes_per_pixel = pl_image_get_bytes_per_pixel(image->format);
-  void *line_ptr, *pel_ptr;
-  uint32_t color = 0;
+  const void *line_ptr;
+  split_row_func split_row;
 
+  if (!(split_row = get_split_row(image->format, image->palette.format)))
+    return 0;
   if (!(bitmap = (uint8_t*)malloc(sizeof(uint8_t) * width * height * 3)))
     return 0;
 
-  for (i = 0, line_ptr = image->bitmap + (image->view.y * image->pitch);
+  /* Skip to the start of the viewport */
+  for (i = 0, line_ptr = image->bitmap + (image->view.y * image->pitch)
+         + (image->view.x * bytes_per_pixel);
        i < height;
        i++, line_ptr += image->pitch)
-  {
-    /* Skip to the start of the viewport */
-    for (j = 0, pel_ptr = line_ptr + (image->view.x * bytes_per_pixel);
-         j < width;
-         j++, pel_ptr += bytes_per_pixel)
-    {
-      copy_from_void(image->format, pel_ptr, &color);
-      pl_image_split_color(image->format,
-                           &image->palette,
-                           color,
-                           &r,&g,&b,&a);
-
-      bitmap[i * width * 3 + j * 3 + 0] = r;
-      bitmap[i * width * 3 + j * 3 + 1] = g;
-      bitmap[i * width * 3 + j * 3 + 2] = b;
-    }
-  }
+    split_row(bitmap + i * width * 3,
+              line_ptr,
+              image->palette.palette,
+              width);
 
   png_struct *pPngStruct = png_create_write_struct( PNG_LIBPNG_VER_STRING,
     NULL, NULL, NULL );
@@ -432,7 +540,7 @@ int pl_image_save_png_stream(const pl_image *image,
   for (y = 0; y < height; y++)
     buf[y] = (uint8_t*)&bitmap[y * width * 3];
 
-  if (png_jmpbuf(pPngStruct))
+  if (setjmp(png_jmpbuf(pPngStruct)))
   {
     free(buf);
     free(bitmap);
@@ -500,10 +608,12 @@ int pl_image_clear(pl_image *image,
                    uint8_t alpha)
 {
   uint32_t color;
-  int x, y;
-  void *line_ptr, *pel_ptr;
-  uint bytes_per_pixel = pl_image_get_bytes_per_pixel(image->format);
+  int y;
+  void *line_ptr;
+  fill_row_func fill_row;
 
+  if (!(fill_row = get_fill_row(image->format)))
+    return 0;
   if (!pl_image_compose_color(image->format,
                               &color,
                               red,
@@ -515,16 +625,9 @@ int pl_image_clear(pl_image *image,
   for (y = 0, line_ptr = image->bitmap;
        y < image->height;
        y++, line_ptr += image->pitch)
-  {
-    for (x = 0, pel_ptr = line_ptr;
-         x < image->line_width;
-         x++, pel_ptr += bytes_per_pixel)
-    {
-      copy_to_void(image->format,
-                   color,
-                   pel_ptr);
-    }
-  }
+    fill_row(line_ptr,
+             color,
+             image->line_width);
 
   return 1;
 }
@@ -559,28 +662,25 @@ int pl_image_create_thumbnail(const pl_image *original,
            pal_size);
   }
 
-  int x, y;
-  uint32_t color = 0;
+  int y;
   uint bytes_per_pixel =
     pl_image_get_bytes_per_pixel(original->format);
-  void *slp = original->bitmap + original->view.y * original->pitch;
-  void *spp;
+  decimate_row_func decimate_row = get_decimate_row(original->format);
+  void *slp = original->bitmap + original->view.y * original->pitch
+    + original->view.x * bytes_per_pixel;
   void *dlp = thumb->bitmap;
-  void *dpp;
+
+  if (!decimate_row)
+  {
+    pl_image_destroy(thumb);
+    return 0;
+  }
 
   /* copy bitmap */
   for (y = 0;
        y < thumb->view.h;
        y++, dlp += thumb->pitch, slp += (original->pitch << 1))
-  {
-    for (x = 0, dpp = dlp, spp = slp + original->view.x * bytes_per_pixel;
-         x < thumb->view.w;
-         x++, dpp += bytes_per_pixel, spp += (bytes_per_pixel << 1))
-    {
-      copy_from_void(original->format, spp, &color);
-      copy_to_void(thumb->format, color, dpp);
-    }
-  }
+    decimate_row(dlp, slp, thumb->view.w);
 
   return 1;
 }
@@ -711,6 +811,7 @@ int copy_from_void(pl_image_format format,
     return 1;
   case 4:
     *to = *(uint32_t*)from;
+    return 1;
   default:
     return 0;
   }
@@ -735,3 +836,44 @@ int copy_to_void(pl_image_format format,
     return 0;
   }
 }
+
+static fill_row_func get_fill_row(pl_image_format format)
+{
+  switch (pl_image_get_bytes_per_pixel(format))
+  {
+  case 1: return fill_row_uint8_t;
+  case 2: return fill_row_uint16_t;
+  case 4: return fill_row_uint32_t;
+  default: return NULL;
+  }
+}
+
+static decimate_row_func get_decimate_row(pl_image_format format)
+{
+  switch (pl_image_get_bytes_per_pixel(format))
+  {
+  case 1: return decimate_row_uint8_t;
+  case 2: return decimate_row_uint16_t;
+  case 4: return decimate_row_uint32_t;
+  default: return NULL;
+  }
+}
+
+static split_row_func get_split_row(pl_image_format format,
+                                    pl_image_format pal_format)
+{
+  switch (format)
+  {
+  case pl_image_indexed:
+    /* Palette's format may not be indexed */
+    switch (pal_format)
+    {
+    case pl_image_4444: return split_row_indexed_4444;
+    case pl_image_5551: return split_row_indexed_5551;
+    default: return NULL;
+    }
+  case pl_image_4444: return split_row_4444;
+  case pl_image_5551: return split_row_5551;
+  default: return NULL;
+  }
+}
@@ -0,0 +1,233 @@
+/* psplib/pl_pixconv.c
+   Pixel format conversion kernels
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PL_PIXCONV_NEON
+#include <arm_neon.h>
+#endif
+
+#include "pl_pixconv.h"
+
+typedef struct
+{
+  uint8_t r, g, b, a;
+} pixel;
+
+/* Scalar loads, one per source layout */
+static inline pixel load_gray(const uint8_t *p)
+{
+  pixel px = { p[0], p[0], p[0], 0xff };
+  return px;
+}
+
+static inline pixel load_gray_alpha(const uint8_t *p)
+{
+  pixel px = { p[0], p[0], p[0], p[1] };
+  return px;
+}
+
+static inline pixel load_bgr(const uint8_t *p)
+{
+  pixel px = { p[2], p[1], p[0], 0xff };
+  return px;
+}
+
+static inline pixel load_bgra(const uint8_t *p)
+{
+  pixel px = { p[2], p[1], p[0], p[3] };
+  return px;
+}
+
+/* Scalar stores, one per destination format */
+static inline void store_5551(void *out,
+                              pixel px)
+{
+  *(uint16_t*)out = ((px.a >> 7) << 15) | ((px.b >> 3) << 10)
+                    | ((px.g >> 3) << 5) | (px.r >> 3);
+}
+
+static inline void store_5551_key(void *out,
+                                  pixel px)
+{
+  *(uint16_t*)out = ((px.a) ? 0x8000 : 0) | ((px.b >> 3) << 10)
+                    | ((px.g >> 3) << 5) | (px.r >> 3);
+}
+
+static inline void store_4444(void *out,
+                              pixel px)
+{
+  *(uint16_t*)out = ((px.a >> 4) << 12) | ((px.b >> 4) << 8)
+                    | ((px.g >> 4) << 4) | (px.r >> 4);
+}
+
+static inline void store_8888(void *out,
+                              pixel px)
+{
+  *(uint32_t*)out = ((uint32_t)px.a << 24) | ((uint32_t)px.b << 16)
+                    | ((uint32_t)px.g << 8) | px.r;
+}
+
+#ifdef PL_PIXCONV_NEON
+/* Eight pixels, one vector per channel */
+typedef struct
+{
+  uint8x8_t r, g, b, a;
+} pixel8;
+
+static inline pixel8 load8_gray(const uint8_t *p)
+{
+  pixel8 px;
+  px.r = px.g = px.b = vld1_u8(p);
+  px.a = vdup_n_u8(0xff);
+  return px;
+}
+
+static inline pixel8 load8_gray_alpha(const uint8_t *p)
+{
+  uint8x8x2_t v = vld2_u8(p);
+  pixel8 px;
+  px.r = px.g = px.b = v.val[0];
+  px.a = v.val[1];
+  return px;
+}
+
+static inline pixel8 load8_bgr(const uint8_t *p)
+{
+  uint8x8x3_t v = vld3_u8(p);
+  pixel8 px;
+  px.b = v.val[0];
+  px.g = v.val[1];
+  px.r = v.val[2];
+  px.a = vdup_n_u8(0xff);
+  return px;
+}
+
+static inline pixel8 load8_bgra(const uint8_t *p)
+{
+  uint8x8x4_t v = vld4_u8(p);
+  pixel8 px;
+  px.b = v.val[0];
+  px.g = v.val[1];
+  px.r = v.val[2];
+  px.a = v.val[3];
+  return px;
+}
+
+/* 5:5:5 colour bits, without alpha */
+static inline uint16x8_t pack8_555(pixel8 px)
+{
+  uint16x8_t v = vmovl_u8(vshr_n_u8(px.r, 3));
+  v = vorrq_u16(v, vshlq_n_u16(vmovl_u8(vshr_n_u8(px.g, 3)), 5));
+  return vorrq_u16(v, vshlq_n_u16(vmovl_u8(vshr_n_u8(px.b, 3)), 10));
+}
+
+static inline void store8_5551(void *out,
+                               pixel8 px)
+{
+  /* Top bit of alpha goes to bit 15 */
+  uint16x8_t a = vshlq_n_u16(vmovl_u8(vshr_n_u8(px.a, 7)), 15);
+  vst1q_u16((uint16_t*)out, vorrq_u16(pack8_555(px), a));
+}
+
+static inline void store8_5551_key(void *out,
+                                   pixel8 px)
+{
+  /* vtst yields 0xff for non-zero alpha; one shift-insert */
+  /* puts its low bit in bit 15 of all eight pixels         */
+  uint16x8_t key = vmovl_u8(vtst_u8(px.a, px.a));
+  vst1q_u16((uint16_t*)out, vsliq_n_u16(pack8_555(px), key, 15));
+}
+
+static inline void store8_4444(void *out,
+                               pixel8 px)
+{
+  /* Low byte is G:R, high byte is A:B */
+  uint8x8x2_t v;
+  v.val[0] = vsri_n_u8(px.g, px.r, 4);
+  v.val[1] = vsri_n_u8(px.a, px.b, 4);
+  vst2_u8((uint8_t*)out, v);
+}
+
+static inline void store8_8888(void *out,
+                               pixel8 px)
+{
+  uint8x8x4_t v;
+  v.val[0] = px.r;
+  v.val[1] = px.g;
+  v.val[2] = px.b;
+  v.val[3] = px.a;
+  vst4_u8((uint8_t*)out, v);
+}
+
+#define NEON_LOOP(src, dst, src_bpp, dst_bpp)          \
+  for (; i + 8 <= width; i += 8, in += 8 * src_bpp,    \
+                                out += 8 * dst_bpp)    \
+    store8_##dst(out, load8_##src(in));
+#else
+#define NEON_LOOP(src, dst, src_bpp, dst_bpp)
+#endif
+
+/* One converter per source/destination pair; NEON handles runs  */
+/* of eight pixels, the scalar loop handles the rest. Pointers   */
+/* are stepped rather than indexed, so that compilers can        */
+/* vectorise the scalar loop where there's no NEON               */
+#define CONVERTER(src, dst, src_bpp, dst_bpp)                     \
+static void src##_to_##dst(void *dest,                            \
+                           const uint8_t *row,                    \
+                           unsigned int width)                    \
+{                                                                 \
+  uint8_t *out = (uint8_t*)dest;                                  \
+  const uint8_t *in = row;                                        \
+  unsigned int i = 0;                                             \
+  NEON_LOOP(src, dst, src_bpp, dst_bpp)                           \
+  for (; i < width; i++, in += src_bpp, out += dst_bpp)           \
+    store_##dst(out, load_##src(in));                             \
+}
+
+#define CONVERTERS(src, src_bpp)       \
+  CONVERTER(src, 5551, src_bpp, 2)     \
+  CONVERTER(src, 5551_key, src_bpp, 2) \
+  CONVERTER(src, 4444, src_bpp, 2)     \
+  CONVERTER(src, 8888, src_bpp, 4)
+
+CONVERTERS(gray, 1)
+CONVERTERS(gray_alpha, 2)
+CONVERTERS(bgr, 3)
+CONVERTERS(bgra, 4)
+
+#define CONVERTER_ROW(src) \
+  { src##_to_5551, src##_to_5551_key, src##_to_4444, src##_to_8888 }
+
+static const pl_pixconv_func converters[PL_PIXCONV_SOURCES][PL_PIXCONV_DESTS] =
+{
+  CONVERTER_ROW(gray),
+  CONVERTER_ROW(gray_alpha),
+  CONVERTER_ROW(bgr),
+  CONVERTER_ROW(bgra),
+};
+
+pl_pixconv_func pl_pixconv_get(int source,
+                               int dest)
+{
+  if (source < 0 || source >= PL_PIXCONV_SOURCES ||
+      dest < 0 || dest >= PL_PIXCONV_DESTS)
+    return NULL;
+  return converters[source][dest];
+}
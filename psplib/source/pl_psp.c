@@ -27,6 +27,7 @@
 #include <psp2/power.h>
 
 #include "pl_psp.h"
+#include "image.h"
 
 typedef struct pl_psp_callback_t
 {
@@ -67,6 +68,8 @@ const char* pl_psp_get_app_directory()
 
 void pl_psp_shutdown()
 {
+  /* Don't lose screenshots still being written */
+  pspImageShutdownSaves();
   sceKernelExitProcess(0);
 }
 
@@ -0,0 +1,322 @@
+/* psplib/pl_resample.c
+   Sample rate conversion
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <math.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define PL_RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "pl_resample.h"
+
+#define SINC_TAPS   16
+#define SINC_PHASES 256
+#define SINC_CUTOFF 0.90 /* Fraction of the lower Nyquist frequency */
+
+#define PHASE_SHIFT (32 - 8) /* log2(SINC_PHASES) */
+
+static void init_coefs(pl_resampler *rs);
+static unsigned int process_linear(pl_resampler *rs,
+                                   short *out,
+                                   unsigned int out_count);
+static unsigned int process_sinc(pl_resampler *rs,
+                                 short *out,
+                                 unsigned int out_count);
+
+static inline short saturate_s16(int32_t sample)
+{
+  if (sample > 32767) return 32767;
+  if (sample < -32768) return -32768;
+  return (short)sample;
+}
+
+int pl_resample_init(pl_resampler *rs,
+                     int in_rate,
+                     int out_rate,
+                     int stereo,
+                     int mode)
+{
+  if (in_rate <= 0 || out_rate <= 0)
+    return 0;
+
+  rs->mode = mode;
+  rs->channels = (stereo) ? 2 : 1;
+  rs->taps = (mode == PL_RESAMPLE_SINC) ? SINC_TAPS : 2;
+  rs->in_rate = in_rate;
+  rs->out_rate = out_rate;
+  rs->base_step = ((uint64_t)in_rate << 32) / out_rate;
+  rs->step = rs->base_step;
+  rs->coefs = NULL;
+
+  if (!(rs->buffer = (short*)memalign(16, PL_RESAMPLE_BUFFER
+                                          * rs->channels * sizeof(short))))
+    return 0;
+
+  if (mode == PL_RESAMPLE_SINC)
+  {
+    if (!(rs->coefs = (short*)memalign(16, (SINC_PHASES + 1)
+                                           * SINC_TAPS * sizeof(short))))
+    {
+      free(rs->buffer);
+      return 0;
+    }
+    init_coefs(rs);
+  }
+
+  pl_resample_reset(rs);
+  return 1;
+}
+
+void pl_resample_destroy(pl_resampler *rs)
+{
+  free(rs->buffer);
+  free(rs->coefs);
+  rs->buffer = NULL;
+  rs->coefs = NULL;
+}
+
+void pl_resample_reset(pl_resampler *rs)
+{
+  /* Prime with silence, so that the first output frame is */
+  /* centered on the first input frame                     */
+  rs->buffered = rs->taps / 2 - 1;
+  rs->position = 0;
+  memset(rs->buffer, 0, rs->buffered * rs->channels * sizeof(short));
+}
+
+void pl_resample_set_skew(pl_resampler *rs,
+                          float skew)
+{
+  /* Skew is tiny; scale in 2^-24 units to keep precision */
+  int64_t scale = (int64_t)(skew * (float)(1 << 24));
+  rs->step = rs->base_step + ((int64_t)rs->base_step * scale >> 24);
+}
+
+unsigned int pl_resample_get_needed(const pl_resampler *rs,
+                                    unsigned int out_count)
+{
+  uint64_t last;
+  unsigned int needed;
+
+  if (!out_count)
+    return 0;
+
+  /* Last output frame reads taps frames starting here */
+  last = (rs->position + rs->step * (out_count - 1)) >> 32;
+  needed = (unsigned int)last + rs->taps;
+
+  return (needed > rs->buffered) ? needed - rs->buffered : 0;
+}
+
+short* pl_resample_get_input(pl_resampler *rs,
+                             unsigned int *space)
+{
+  unsigned int consumed = (unsigned int)(rs->position >> 32);
+
+  /* Move unread frames to the front */
+  if (consumed > rs->buffered)
+    consumed = rs->buffered;
+  if (consumed)
+  {
+    memmove(rs->buffer, rs->buffer + consumed * rs->channels,
+            (rs->buffered - consumed) * rs->channels * sizeof(short));
+    rs->buffered -= consumed;
+    rs->position -= (uint64_t)consumed << 32;
+  }
+
+  *space = PL_RESAMPLE_BUFFER - rs->buffered;
+  return rs->buffer + rs->buffered * rs->channels;
+}
+
+void pl_resample_commit(pl_resampler *rs,
+                        unsigned int count)
+{
+  rs->buffered += count;
+}
+
+unsigned int pl_resample_process(pl_resampler *rs,
+                                 short *out,
+                                 unsigned int out_count)
+{
+  return (rs->mode == PL_RESAMPLE_SINC)
+    ? process_sinc(rs, out, out_count)
+    : process_linear(rs, out, out_count);
+}
+
+static unsigned int process_linear(pl_resampler *rs,
+                                   short *out,
+                                   unsigned int out_count)
+{
+  const short *in = rs->buffer;
+  uint64_t position = rs->position;
+  uint64_t limit = (uint64_t)(rs->buffered - 1) << 32;
+  unsigned int i;
+  int32_t frac;
+  const short *a;
+
+  if (rs->buffered < 2)
+    return 0;
+
+  if (rs->channels == 2)
+  {
+    for (i = 0; i < out_count && position < limit; i++)
+    {
+      a = in + (position >> 32) * 2;
+      frac = (uint32_t)position >> 17; /* Q15 */
+      out[0] = a[0] + (((a[2] - a[0]) * frac) >> 15);
+      out[1] = a[1] + (((a[3] - a[1]) * frac) >> 15);
+      out += 2;
+      position += rs->step;
+    }
+  }
+  else
+  {
+    for (i = 0; i < out_count && position < limit; i++)
+    {
+      a = in + (position >> 32);
+      frac = (uint32_t)position >> 17;
+      *out++ = a[0] + (((a[1] - a[0]) * frac) >> 15);
+      position += rs->step;
+    }
+  }
+
+  rs->position = position;
+  return i;
+}
+
+static unsigned int process_sinc(pl_resampler *rs,
+                                 short *out,
+                                 unsigned int out_count)
+{
+  const short *in = rs->buffer;
+  uint64_t position = rs->position;
+  unsigned int i, phase;
+  const short *frame, *coefs;
+  int32_t left, right;
+
+  if (rs->buffered < SINC_TAPS)
+    return 0;
+
+  /* Last position with a full window of input */
+  uint64_t limit = (uint64_t)(rs->buffered - SINC_TAPS + 1) << 32;
+
+  for (i = 0; i < out_count && position < limit; i++)
+  {
+    /* Nearest phase; phase SINC_PHASES is the next frame's 0 */
+    phase = (uint32_t)(((uint32_t)position >> (PHASE_SHIFT - 1)) + 1) >> 1;
+    coefs = rs->coefs + phase * SINC_TAPS;
+
+    if (rs->channels == 2)
+    {
+      frame = in + (position >> 32) * 2;
+#ifdef PL_RESAMPLE_NEON
+      int16x8x2_t f0 = vld2q_s16(frame);
+      int16x8x2_t f1 = vld2q_s16(frame + 16);
+      int16x8_t c0 = vld1q_s16(coefs);
+      int16x8_t c1 = vld1q_s16(coefs + 8);
+      int32x4_t l = vmull_s16(vget_low_s16(f0.val[0]), vget_low_s16(c0));
+      int32x4_t r = vmull_s16(vget_low_s16(f0.val[1]), vget_low_s16(c0));
+      l = vmlal_s16(l, vget_high_s16(f0.val[0]), vget_high_s16(c0));
+      r = vmlal_s16(r, vget_high_s16(f0.val[1]), vget_high_s16(c0));
+      l = vmlal_s16(l, vget_low_s16(f1.val[0]), vget_low_s16(c1));
+      r = vmlal_s16(r, vget_low_s16(f1.val[1]), vget_low_s16(c1));
+      l = vmlal_s16(l, vget_high_s16(f1.val[0]), vget_high_s16(c1));
+      r = vmlal_s16(r, vget_high_s16(f1.val[1]), vget_high_s16(c1));
+      int32x2_t lr = vpadd_s32(vadd_s32(vget_low_s32(l), vget_high_s32(l)),
+                               vadd_s32(vget_low_s32(r), vget_high_s32(r)));
+      left = vget_lane_s32(lr, 0);
+      right = vget_lane_s32(lr, 1);
+#else
+      int k;
+      for (k = 0, left = 0, right = 0; k < SINC_TAPS; k++)
+      {
+        left += frame[k * 2] * coefs[k];
+        right += frame[k * 2 + 1] * coefs[k];
+      }
+#endif
+      out[0] = saturate_s16(left >> 15);
+      out[1] = saturate_s16(right >> 15);
+      out += 2;
+    }
+    else
+    {
+      frame = in + (position >> 32);
+#ifdef PL_RESAMPLE_NEON
+      int16x8_t f0 = vld1q_s16(frame);
+      int16x8_t f1 = vld1q_s16(frame + 8);
+      int16x8_t c0 = vld1q_s16(coefs);
+      int16x8_t c1 = vld1q_s16(coefs + 8);
+      int32x4_t m = vmull_s16(vget_low_s16(f0), vget_low_s16(c0));
+      m = vmlal_s16(m, vget_high_s16(f0), vget_high_s16(c0));
+      m = vmlal_s16(m, vget_low_s16(f1), vget_low_s16(c1));
+      m = vmlal_s16(m, vget_high_s16(f1), vget_high_s16(c1));
+      int32x2_t s = vadd_s32(vget_low_s32(m), vget_high_s32(m));
+      left = vget_lane_s32(vpadd_s32(s, s), 0);
+#else
+      int k;
+      for (k = 0, left = 0; k < SINC_TAPS; k++)
+        left += frame[k] * coefs[k];
+#endif
+      *out++ = saturate_s16(left >> 15);
+    }
+
+    position += rs->step;
+  }
+
+  rs->position = position;
+  return i;
+}
+
+/* Blackman-windowed sinc, one row of taps per phase. Each row */
+/* is normalized to unity gain in Q15                          */
+static void init_coefs(pl_resampler *rs)
+{
+  double cutoff, x, w, sum, row[SINC_TAPS];
+  int phase, k, center = SINC_TAPS / 2 - 1;
+  short *coef;
+
+  /* Lowpass at the lower of the two Nyquist frequencies */
+  cutoff = SINC_CUTOFF;
+  if (rs->out_rate < rs->in_rate)
+    cutoff *= (double)rs->out_rate / rs->in_rate;
+
+  for (phase = 0; phase <= SINC_PHASES; phase++)
+  {
+    for (k = 0, sum = 0; k < SINC_TAPS; k++)
+    {
+      x = (k - center) - (double)phase / SINC_PHASES;
+      w = 0.42 + 0.5 * cos(M_PI * x / (SINC_TAPS / 2))
+          + 0.08 * cos(2 * M_PI * x / (SINC_TAPS / 2));
+      if (fabs(x) >= SINC_TAPS / 2) w = 0;
+      row[k] = (x == 0) ? cutoff
+        : sin(M_PI * cutoff * x) / (M_PI * x);
+      row[k] *= w;
+      sum += row[k];
+    }
+
+    coef = rs->coefs + phase * SINC_TAPS;
+    for (k = 0; k < SINC_TAPS; k++)
+    {
+      x = row[k] / sum * 32768.0;
+      coef[k] = (x > 32767) ? 32767 : (short)floor(x + 0.5);
+    }
+  }
+}
@@ -22,154 +22,1532 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <psp2/kernel/threadmgr.h>
+#include <psp2/io/fcntl.h>
+#include <psp2/rtc.h>
 
 #include "pl_rewind.h"
+#include "pl_delta.h"
+#include "pl_file.h"
+
+/* Rough compression ratio assumed when sizing the slot ring */
+#define REWIND_EXPECTED_RATIO 16
+
+#define REWIND_KEYFRAME 0x01 /* XOR'ed against zero, not previous state */
+#define REWIND_RAW      0x02 /* Uncompressed XOR block */
+#define REWIND_PAGED    0x04 /* Table of indices into the page store */
+
+#define JOURNAL_BUFFERS 2
+
+#define ALIGN4(n)  (((n) + 3) & ~3)
+#define ALIGN16(n) (((n) + 15) & ~15)
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 typedef struct rewind_state
 {
-  void *data;
-  struct rewind_state *prev;
-  struct rewind_state *next;
+  int offset; /* Into the data ring */
+  int size;
+  unsigned char flags;
 } rewind_state_t;
 
+typedef struct rewind_page
+{
+  unsigned int hash;
+  int refs;
+  int next; /* Next page in the hash chain or free list */
+} rewind_page_t;
+
+#define PAGE_DATA(r, i) ((r)->page_data + (i) * PL_REWIND_PAGE_SIZE)
+
+/* Precedes and follows each journal record, so that the */
+/* journal can be walked in both directions              */
+typedef struct rewind_record
+{
+  int size;
+  int flags;
+} rewind_record_t;
+
+typedef struct rewind_journal
+{
+  SceUID fd;
+  int thread;
+  int full_sema;  /* Blocks waiting to be written */
+  int empty_sema; /* Blocks available for filling */
+  volatile int stop;
+  volatile int error;
+  int size;       /* Logical end of the journal */
+  int records;
+  int fill;       /* Block being filled */
+  int filling;
+  int flush_next; /* Next block to be written */
+  unsigned char *blocks[JOURNAL_BUFFERS];
+  int block_len[JOURNAL_BUFFERS];
+  int block_offset[JOURNAL_BUFFERS];
+  unsigned char *cache; /* Readahead window */
+  int cache_offset;
+  int cache_len;
+  pl_file_path path;
+} rewind_journal_t;
+
+static int init_ring(pl_rewind *rewind,
+                     int (*save_state)(void *),
+                     int (*load_state)(void *),
+                     int (*get_state_size)(),
+                     int arena_size,
+                     int frames);
+static int init_arena(pl_rewind *rewind,
+                      int arena_size,
+                      int state_count,
+                      int page_count);
+static int get_store_size(int page_count,
+                          int *bucket_count);
+static void clear_ring(pl_rewind *rewind);
+static void drop_slot(pl_rewind *rewind,
+                      int index);
+static int alloc_data(const pl_rewind *rewind,
+                      int size);
+static int save_snapshot(pl_rewind *rewind);
+static int seek_snapshot(pl_rewind *rewind,
+                         int frames_back);
+static void count_ticks(uint64_t start,
+                        int *count,
+                        uint64_t *total,
+                        uint64_t *max);
+static int store_state(pl_rewind *rewind,
+                       const void *state);
+static int append_slot(pl_rewind *rewind,
+                       const void *data,
+                       int size,
+                       unsigned char flags);
+static int stage_state(pl_rewind *rewind);
+static void flush_worker(pl_rewind *rewind);
+static int worker_thread(SceSize args, void *argp);
+static void release_oldest_group(pl_rewind *rewind);
+static int get_key_distance(const pl_rewind *rewind,
+                            int index);
+static int encode_state(pl_rewind *rewind,
+                        const void *state,
+                        int keyframe,
+                        unsigned char *flags,
+                        int *stored);
+static int compress_state(pl_rewind *rewind,
+                          const void *state,
+                          int keyframe,
+                          unsigned char *flags);
+static void clear_pages(pl_rewind *rewind);
+static int page_state(pl_rewind *rewind,
+                      const void *state,
+                      int *stored);
+static int ref_page(pl_rewind *rewind,
+                   const unsigned char *src,
+                   int len,
+                   int *stored);
+static void unref_page(pl_rewind *rewind,
+                       int index);
+static unsigned int hash_page(const unsigned char *src,
+                              int len);
+static int rebuild_state(const pl_rewind *rewind,
+                         int index,
+                         void *state);
+static int apply_slot(const pl_rewind *rewind,
+                      const rewind_state_t *slot,
+                      void *state);
+static int open_journal(pl_rewind *rewind,
+                        const char *path);
+static void close_journal(pl_rewind *rewind);
+static void journal_push(pl_rewind *rewind,
+                         const rewind_state_t *slot);
+static void journal_append(rewind_journal_t *journal,
+                           const void *data,
+                           int len);
+static void journal_submit(rewind_journal_t *journal);
+static void journal_flush(rewind_journal_t *journal);
+static int journal_read(rewind_journal_t *journal,
+                        int offset,
+                        void *dest,
+                        int len);
+static int pop_journal_group(pl_rewind *rewind);
+static int journal_thread(SceSize args, void *argp);
 static int get_free_memory();
 
+#define NEXT_SLOT(r, i) (((i) + 1) % (r)->state_count)
+#define PREV_SLOT(r, i) (((i) + (r)->state_count - 1) % (r)->state_count)
+
 int pl_rewind_init(pl_rewind *rewind,
   int (*save_state)(void *),
   int (*load_state)(void *),
   int (*get_state_size)())
 {
-	float memory_needed = (float)get_free_memory() * 0.85;
-  int state_data_size = get_state_size();
-  int state_count = (int)(memory_needed 
-                    / (float)(state_data_size + sizeof(rewind_state_t)));
+  /* Neither a budget nor a frame count; sized from free memory */
+  return init_ring(rewind,
+                   save_state,
+                   load_state,
+                   get_state_size,
+                   0,
+                   0);
+}
 
-	if (state_count < 1)
-    return 0;
+/* Sizes the ring to fit in memory_budget bytes */
+int pl_rewind_init_budget(pl_rewind *rewind,
+  int (*save_state)(void *),
+  int (*load_state)(void *),
+  int (*get_state_size)(),
+  int memory_budget)
+{
+  return init_ring(rewind,
+                   save_state,
+                   load_state,
+                   get_state_size,
+                   memory_budget,
+                   0);
+}
 
-  /* First state */
-  rewind_state_t *prev, *curr = NULL;
-  if (!(rewind->start = (rewind_state_t*)malloc(sizeof(rewind_state_t))))
-    return 0;
+/* Sizes the ring to hold the specified number of saves */
+int pl_rewind_init_frames(pl_rewind *rewind,
+  int (*save_state)(void *),
+  int (*load_state)(void *),
+  int (*get_state_size)(),
+  int frames)
+{
+  return init_ring(rewind,
+                   save_state,
+                   load_state,
+                   get_state_size,
+                   0,
+                   frames);
+}
 
-  if (!(rewind->start->data = malloc(state_data_size)))
-  {
-    free(rewind->start);
-    rewind->start = NULL;
-    return 0;
-  }
+void pl_rewind_get_info(pl_rewind *rewind,
+                        pl_rewind_info *info)
+{
+  /* Ring is updated by the worker */
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
 
-  prev = rewind->start;
+  info->slot_count = rewind->state_count;
+  info->slots_used = rewind->count;
+  info->bytes_used = rewind->memory_used;
+  info->ring_size = rewind->memory_budget;
+  info->page_count = rewind->page_count;
+  info->pages_used = rewind->pages_used;
+  info->journal_slots = (rewind->journal) ? rewind->journal->records : 0;
+  info->journal_bytes = (rewind->journal) ? rewind->journal->size : 0;
+  info->bytes_total = (rewind->data - (unsigned char*)rewind->arena)
+                      + rewind->memory_budget;
+}
+
+void pl_rewind_get_stats(pl_rewind *rewind,
+                         pl_rewind_stats *stats)
+{
+  const pl_rewind_counters *counters = &rewind->counters;
+  float ticks_per_ms = (float)sceRtcGetTickResolution() / 1000.0f;
+
+  /* Compression counters are updated by the worker */
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+
+  sceRtcGetCurrentTick(&stats->timestamp);
+  stats->seconds = (float)(stats->timestamp - counters->since)
+                   / (ticks_per_ms * 1000.0f);
+
+  stats->saves = counters->saves;
+  stats->save_avg_ms = (counters->saves)
+    ? (float)counters->save_ticks / counters->saves / ticks_per_ms : 0;
+  stats->save_max_ms = (float)counters->save_max / ticks_per_ms;
+
+  stats->restores = counters->restores;
+  stats->restore_avg_ms = (counters->restores)
+    ? (float)counters->restore_ticks / counters->restores / ticks_per_ms : 0;
+  stats->restore_max_ms = (float)counters->restore_max / ticks_per_ms;
+
+  stats->bytes_per_slot = (rewind->count)
+    ? (float)rewind->memory_used / rewind->count : 0;
+  stats->compression_ratio = (counters->bytes_out)
+    ? (float)counters->bytes_in / counters->bytes_out : 0;
+
+  stats->slots_used = rewind->count;
+  stats->slot_count = rewind->state_count;
+}
+
+void pl_rewind_reset_stats(pl_rewind *rewind)
+{
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+
+  memset(&rewind->counters, 0, sizeof(pl_rewind_counters));
+  sceRtcGetCurrentTick(&rewind->counters.since);
+}
 
-  /* The rest */
+/* Moves compression to a background thread; pl_rewind_save() */
+/* then only captures the snapshot into a staging buffer, and  */
+/* a snapshot the worker fails to store is reported by the     */
+/* next save. Turning it off returns 0 if the last one failed  */
+int pl_rewind_set_async(pl_rewind *rewind,
+                        int async)
+{
   int i;
-  for (i = 1; i < state_count; i++)
+
+  if (!async)
   {
-    /* If allocation fails, compose a shorter state chain */
-    if (!(curr = (rewind_state_t*)malloc(sizeof(rewind_state_t))))
+    if (rewind->worker_thread < 0)
+      return 1;
+
+    /* Let the worker finish pending snapshots, then stop it */
+    flush_worker(rewind);
+    rewind->worker_stop = 1;
+    sceKernelSignalSema(rewind->staged_sema, 1);
+    sceKernelWaitThreadEnd(rewind->worker_thread, NULL, NULL);
+    sceKernelDeleteThread(rewind->worker_thread);
+    sceKernelDeleteSema(rewind->staged_sema);
+    sceKernelDeleteSema(rewind->free_sema);
+
+    for (i = 0; i < PL_REWIND_STAGING_BUFFERS; i++)
     {
-      state_count = i + 1;
-      break;
+      free(rewind->staging[i]);
+      rewind->staging[i] = NULL;
     }
 
-    /* If allocation fails, compose a shorter state chain */
-    if (!(curr->data = malloc(state_data_size)))
-    {
-      state_count = i + 1;
-      free(curr);
+    rewind->worker_thread = -1;
+    return !__sync_lock_test_and_set(&rewind->worker_error, 0);
+  }
+
+  if (rewind->worker_thread >= 0)
+    return 1;
+  if (!rewind->arena)
+    return 0;
+
+  for (i = 0; i < PL_REWIND_STAGING_BUFFERS; i++)
+    rewind->staging[i] = memalign(16, ALIGN16(rewind->state_data_size));
+
+  rewind->stage_in = rewind->stage_out = 0;
+  rewind->worker_stop = 0;
+  rewind->worker_error = 0;
+  rewind->staged_sema = sceKernelCreateSema("rewind_staged", 0, 0,
+                                            PL_REWIND_STAGING_BUFFERS, NULL);
+  rewind->free_sema = sceKernelCreateSema("rewind_free", 0,
+                                          PL_REWIND_STAGING_BUFFERS,
+                                          PL_REWIND_STAGING_BUFFERS, NULL);
+  rewind->worker_thread = sceKernelCreateThread("rewind_worker",
+                                                worker_thread,
+                                                0x10000100, 0x4000,
+                                                0, 0, NULL);
+
+  for (i = 0; i < PL_REWIND_STAGING_BUFFERS; i++)
+    if (!rewind->staging[i])
       break;
+
+  if (i < PL_REWIND_STAGING_BUFFERS ||
+      rewind->staged_sema < 0 ||
+      rewind->free_sema < 0 ||
+      rewind->worker_thread < 0 ||
+      sceKernelStartThread(rewind->worker_thread,
+                           sizeof(rewind), &rewind) < 0)
+  {
+    if (rewind->worker_thread >= 0)
+      sceKernelDeleteThread(rewind->worker_thread);
+    if (rewind->staged_sema >= 0)
+      sceKernelDeleteSema(rewind->staged_sema);
+    if (rewind->free_sema >= 0)
+      sceKernelDeleteSema(rewind->free_sema);
+
+    for (i = 0; i < PL_REWIND_STAGING_BUFFERS; i++)
+    {
+      free(rewind->staging[i]);
+      rewind->staging[i] = NULL;
     }
 
-    prev->next = curr;
-    curr->prev = prev;
-    prev = curr;
+    rewind->worker_thread = -1;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Streams evicted snapshots to the file at path instead of */
+/* dropping them. A NULL path disables (and deletes) the     */
+/* journal                                                   */
+int pl_rewind_set_journal(pl_rewind *rewind,
+                          const char *path)
+{
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+
+  if (rewind->journal)
+    close_journal(rewind);
+
+  if (!path)
+    return 1;
+
+  return open_journal(rewind, path);
+}
+
+void pl_rewind_realloc(pl_rewind *rewind)
+{
+  int async = (rewind->worker_thread >= 0);
+  int journal = (rewind->journal != NULL);
+  pl_file_path journal_path;
+
+  if (journal)
+    strcpy(journal_path, rewind->journal->path);
+
+  pl_rewind_destroy(rewind);
+  if (!init_ring(rewind,
+                 rewind->save_state,
+                 rewind->load_state,
+                 rewind->get_state_size,
+                 rewind->arena_size,
+                 rewind->frame_target))
+    return;
+
+  if (async)
+    pl_rewind_set_async(rewind, 1);
+  if (journal)
+    pl_rewind_set_journal(rewind, journal_path);
+}
+
+void pl_rewind_destroy(pl_rewind *rewind)
+{
+  pl_rewind_set_async(rewind, 0);
+  pl_rewind_set_journal(rewind, NULL);
+  free(rewind->arena);
+
+  rewind->arena = NULL;
+  rewind->slots = NULL;
+  rewind->data = NULL;
+  rewind->last_state = NULL;
+  rewind->work_state = NULL;
+  rewind->encode_buffer = NULL;
+  rewind->count = 0;
+  rewind->memory_used = 0;
+}
+
+void pl_rewind_reset(pl_rewind *rewind)
+{
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+  clear_ring(rewind);
+
+  if (rewind->journal)
+  {
+    journal_flush(rewind->journal);
+    rewind->journal->size = 0;
+    rewind->journal->records = 0;
+  }
+}
+
+int pl_rewind_save(pl_rewind *rewind)
+{
+  uint64_t start;
+
+  sceRtcGetCurrentTick(&start);
+  if (!save_snapshot(rewind))
+    return 0;
+
+  count_ticks(start, &rewind->counters.saves,
+              &rewind->counters.save_ticks, &rewind->counters.save_max);
+  return 1;
+}
+
+int pl_rewind_restore(pl_rewind *rewind)
+{
+  return pl_rewind_seek(rewind, 1);
+}
+
+/* Loads the state saved frames_back saves ago (1 being the */
+/* newest) with a single call to load_state. Anything newer */
+/* is discarded. If a stored delta turns out to be corrupt, */
+/* the whole history is discarded and 0 is returned         */
+int pl_rewind_seek(pl_rewind *rewind,
+                   int frames_back)
+{
+  uint64_t start;
+
+  sceRtcGetCurrentTick(&start);
+  if (!seek_snapshot(rewind, frames_back))
+    return 0;
+
+  count_ticks(start, &rewind->counters.restores,
+              &rewind->counters.restore_ticks, &rewind->counters.restore_max);
+  return 1;
+}
+
+static int save_snapshot(pl_rewind *rewind)
+{
+  if (rewind->worker_thread >= 0)
+    return stage_state(rewind);
+
+	if (!rewind->save_state(rewind->work_state))
+    return 0;
+
+  if (!store_state(rewind, rewind->work_state))
+    return 0;
+
+  /* Newly saved state becomes the base for the next delta */
+  void *temp = rewind->last_state;
+  rewind->last_state = rewind->work_state;
+  rewind->work_state = temp;
+
+  return 1;
+}
+
+static int seek_snapshot(pl_rewind *rewind,
+                         int frames_back)
+{
+  int i, target, deltas, count;
+
+  /* In-flight snapshots must land before the newest is loaded */
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+
+  if (!rewind->count || frames_back < 1)
+    return 0;
+
+  /* Anything older than the ring comes back from the journal */
+  while (frames_back > rewind->count &&
+         rewind->journal && rewind->journal->records)
+  {
+    count = rewind->count;
+    if (!pop_journal_group(rewind))
+      break;
+    frames_back -= count;
+  }
+
+  /* A broken journal may have taken the ring's contents with it */
+  if (!rewind->count)
+    return 0;
+
+  /* Can't go past the starting point */
+  if (frames_back > rewind->count)
+    frames_back = rewind->count;
+
+  target = (rewind->head + rewind->state_count - (frames_back - 1))
+           % rewind->state_count;
+
+  /* Undo deltas one by one if they all share the newest slot's */
+  /* keyframe and that's cheaper than rebuilding from it        */
+  deltas = get_key_distance(rewind, rewind->head);
+  if (frames_back - 1 <= deltas &&
+      frames_back - 1 <= deltas - (frames_back - 1) + 1)
+  {
+    for (i = rewind->head; i != target; i = PREV_SLOT(rewind, i))
+      if (!apply_slot(rewind, &rewind->slots[i], rewind->last_state))
+        goto corrupt;
+  }
+  else if (frames_back > 1 &&
+           !rebuild_state(rewind, target, rewind->last_state))
+    goto corrupt;
+
+  if (!rewind->load_state(rewind->last_state))
+  {
+    if (frames_back > 1 &&
+        !rebuild_state(rewind, rewind->head, rewind->last_state))
+      goto corrupt;
+    return 0;
+  }
+
+  /* Discard slots newer than the target */
+  for (i = rewind->head; i != target; i = PREV_SLOT(rewind, i))
+    drop_slot(rewind, i);
+  rewind->count -= frames_back - 1;
+  rewind->head = target;
+  rewind->data_head = ALIGN4(rewind->slots[target].offset
+                             + rewind->slots[target].size);
+
+  /* Discard the target too, unless it's the starting point */
+  if (rewind->count > 1)
+  {
+    const rewind_state_t *load_slot = &rewind->slots[target];
+    int prev = PREV_SLOT(rewind, target);
+
+    /* XOR deltas are symmetric - undoing one yields the previous */
+    /* state; stepping across a keyframe needs a full rebuild     */
+    if ((load_slot->flags & REWIND_KEYFRAME)
+          ? !rebuild_state(rewind, prev, rewind->last_state)
+          : !apply_slot(rewind, load_slot, rewind->last_state))
+      goto corrupt;
+
+    rewind->data_head = load_slot->offset;
+    drop_slot(rewind, target);
+    rewind->head = prev;
+    rewind->count--;
+  }
+  else if (rewind->journal && rewind->journal->records)
+  {
+    /* Target was the oldest slot in the ring; older ones remain */
+    /* in the journal                                            */
+    pop_journal_group(rewind);
   }
 
-  /* Make circular */
-  rewind->start->prev = prev;
-  curr->next = rewind->start;
+  return 1;
+
+corrupt:
+  /* Nothing in the ring can be trusted as a delta base; the */
+  /* next save starts over with a keyframe                   */
+  clear_ring(rewind);
+  return 0;
+}
+
+/* Returns the number of saves that can be rewound */
+int pl_rewind_get_available(pl_rewind *rewind)
+{
+  if (rewind->worker_thread >= 0)
+    flush_worker(rewind);
+  return rewind->count
+    + ((rewind->journal) ? rewind->journal->records : 0);
+}
+
+static int init_ring(pl_rewind *rewind,
+                     int (*save_state)(void *),
+                     int (*load_state)(void *),
+                     int (*get_state_size)(),
+                     int arena_size,
+                     int frames)
+{
+  int state_data_size = get_state_size();
+  int page_count = -1;
 
-  /* Init structure */
-  rewind->current = NULL;
+  rewind->arena = NULL;
+  rewind->journal = NULL;
+  rewind->worker_thread = -1;
+  pl_rewind_reset_stats(rewind);
   rewind->save_state = save_state;
   rewind->load_state = load_state;
   rewind->get_state_size = get_state_size;
   rewind->state_data_size = state_data_size;
+  rewind->arena_size = arena_size;
+  rewind->frame_target = frames;
+
+  if (state_data_size <= 0)
+    return 0;
+
+  if (arena_size <= 0 && frames <= 0)
+  {
+    /* pl_rewind_init(): take most of the memory that's free. If  */
+    /* the heap is too fragmented for one block that size, settle */
+    /* for less, down to the work buffers and a small ring        */
+    int min_size = ALIGN16(state_data_size) * 5;
+
+    for (arena_size = (int)((float)get_free_memory() * 0.85); ;
+         arena_size /= 2)
+    {
+      if (arena_size < min_size)
+        arena_size = min_size;
+      if (init_arena(rewind, arena_size, 0, -1))
+        return 1;
+      if (arena_size == min_size)
+        return 0;
+    }
+  }
+  else if (frames > 0)
+  {
+    /* Keyframes at full size, deltas at the expected ratio */
+    int keyframes = frames / PL_REWIND_DEFAULT_KEY_INTERVAL + 1;
+    int pages_per_state = (state_data_size + PL_REWIND_PAGE_SIZE - 1)
+                          / PL_REWIND_PAGE_SIZE;
+    arena_size = ALIGN16(state_data_size) * 3
+                 + ALIGN16(frames * sizeof(rewind_state_t))
+                 + frames * (state_data_size / REWIND_EXPECTED_RATIO);
+
+    if (pages_per_state < 4)
+      arena_size += keyframes * state_data_size;
+    else
+    {
+      /* Keyframes live in a page store on top of the ring, with */
+      /* room for one more being stored before the oldest group  */
+      /* is dropped. The ring keeps their page tables, plus one   */
+      /* inline keyframe                                          */
+      page_count = (keyframes + 1) * pages_per_state;
+      arena_size += get_store_size(page_count, NULL)
+                    + keyframes * pages_per_state * sizeof(int)
+                    + state_data_size;
+    }
+  }
+
+  return init_arena(rewind, arena_size, frames, page_count);
+}
+
+/* Carves the slot table, work buffers, page store and data  */
+/* ring out of a single allocation. If state_count is 0, it's */
+/* derived from the arena size; if page_count is negative,    */
+/* the page store takes a share of the ring                   */
+static int init_arena(pl_rewind *rewind,
+                      int arena_size,
+                      int state_count,
+                      int page_count)
+{
+  int state_data_size = rewind->state_data_size;
+  int buffer_size = ALIGN16(state_data_size);
+  int ring_size = arena_size - buffer_size * 3;
+  int pages_per_state = (state_data_size + PL_REWIND_PAGE_SIZE - 1)
+                        / PL_REWIND_PAGE_SIZE;
+  int bucket_count = 0, store_size = 0;
+
+  /* Half of the ring goes to the page store, as long as that's */
+  /* enough for two distinct keyframes. Small states aren't     */
+  /* worth splitting                                            */
+  if (page_count < 0 && pages_per_state < 4)
+    page_count = 0;
+  else if (page_count < 0)
+  {
+    page_count = (ring_size / 2)
+      / (PL_REWIND_PAGE_SIZE + sizeof(rewind_page_t) + sizeof(int) * 2);
+    if (page_count < pages_per_state * 2)
+      page_count = 0;
+  }
+
+  if (page_count)
+  {
+    store_size = get_store_size(page_count, &bucket_count);
+    ring_size -= store_size;
+  }
+
+  if (state_count <= 0)
+    state_count = ring_size
+                  / (state_data_size / REWIND_EXPECTED_RATIO
+                     + sizeof(rewind_state_t));
+
+  int table_size = ALIGN16(state_count * sizeof(rewind_state_t));
+  ring_size -= table_size;
+
+  /* Ring must hold at least one keyframe */
+  if (state_count < 1 || ring_size < state_data_size)
+    return 0;
+
+  unsigned char *arena;
+  if (!(arena = (unsigned char*)memalign(16, arena_size)))
+    return 0;
+
+  rewind->arena = arena;
+  rewind->slots = (rewind_state_t*)arena;
+  arena += table_size;
+  rewind->last_state = arena;
+  arena += buffer_size;
+  rewind->work_state = arena;
+  arena += buffer_size;
+  rewind->encode_buffer = arena;
+  arena += buffer_size;
+  rewind->buckets = (int*)arena;
+  arena += ALIGN16(bucket_count * sizeof(int));
+  rewind->pages = (rewind_page_t*)arena;
+  arena += ALIGN16(page_count * sizeof(rewind_page_t));
+  rewind->page_data = arena;
+  arena += page_count * PL_REWIND_PAGE_SIZE;
+  rewind->data = arena;
+
   rewind->state_count = state_count;
+  rewind->memory_budget = ring_size;
+  rewind->key_interval = PL_REWIND_DEFAULT_KEY_INTERVAL;
+  rewind->page_count = page_count;
+  rewind->bucket_mask = bucket_count - 1;
+  rewind->count = 0;
+  clear_pages(rewind);
+  clear_ring(rewind);
 
   return 1;
 }
 
-void pl_rewind_realloc(pl_rewind *rewind)
+/* Bytes taken by a page store of page_count pages */
+static int get_store_size(int page_count,
+                          int *bucket_count)
 {
-  pl_rewind_destroy(rewind);
-  pl_rewind_init(rewind,
-    rewind->save_state,
-    rewind->load_state,
-    rewind->get_state_size);
+  int buckets;
+
+  for (buckets = 1; buckets < page_count; buckets <<= 1);
+  if (bucket_count)
+    *bucket_count = buckets;
+
+  return ALIGN16(buckets * sizeof(int))
+         + ALIGN16(page_count * sizeof(rewind_page_t))
+         + page_count * PL_REWIND_PAGE_SIZE;
 }
 
-void pl_rewind_destroy(pl_rewind *rewind)
+static void count_ticks(uint64_t start,
+                        int *count,
+                        uint64_t *total,
+                        uint64_t *max)
 {
-  rewind->start->prev->next = NULL; /* Prevent infinite loop */
-	rewind_state_t *curr, *next;
+  uint64_t now, elapsed;
+
+  sceRtcGetCurrentTick(&now);
+  elapsed = now - start;
 
-  for (curr = rewind->start; curr; curr = next)
+  (*count)++;
+  *total += elapsed;
+  if (elapsed > *max)
+    *max = elapsed;
+}
+
+static void clear_ring(pl_rewind *rewind)
+{
+  /* Return pages held by any remaining keyframes */
+  for (; rewind->count > 0; rewind->count--)
   {
-    next = curr->next;
-    free(curr->data);
-    free(curr);
+    drop_slot(rewind, rewind->tail);
+    rewind->tail = NEXT_SLOT(rewind, rewind->tail);
   }
 
-  rewind->start = NULL;
-  rewind->current = NULL;
+  rewind->head = 0;
+  rewind->tail = 0;
+  rewind->count = 0;
+  rewind->data_head = 0;
+  rewind->memory_used = 0;
 }
 
-void pl_rewind_reset(pl_rewind *rewind)
+/* Compresses state into the ring; caller is responsible for */
+/* making it the new delta base (last_state)                  */
+static int store_state(pl_rewind *rewind,
+                       const void *state)
 {
-  rewind->current = NULL;
+  unsigned char flags;
+  int keyframe, size, stored;
+
+  keyframe = !rewind->count ||
+    get_key_distance(rewind, rewind->head) + 1 >= rewind->key_interval;
+  size = encode_state(rewind, state, keyframe, &flags, &stored);
+
+  /* Make room by dropping the oldest keyframe and its deltas */
+  while (rewind->count >= rewind->state_count ||
+         alloc_data(rewind, size) < 0)
+  {
+    if (!rewind->count)
+      break; /* Won't fit even in an empty ring */
+
+    release_oldest_group(rewind);
+
+    /* Delta base is gone; snapshot must be stored in full */
+    if (!rewind->count && !keyframe)
+    {
+      keyframe = 1;
+      size = encode_state(rewind, state, keyframe, &flags, &stored);
+    }
+  }
+
+  if (!append_slot(rewind, rewind->encode_buffer, size, flags))
+  {
+    if (flags & REWIND_PAGED)
+    {
+      int i, *table = (int*)rewind->encode_buffer;
+      for (i = 0; i < size / (int)sizeof(int); i++)
+        unref_page(rewind, table[i]);
+    }
+    return 0;
+  }
+
+  rewind->counters.compressed++;
+  rewind->counters.bytes_in += rewind->state_data_size;
+  rewind->counters.bytes_out += size + stored;
+
+  return 1;
 }
 
-int pl_rewind_save(pl_rewind *rewind)
+/* Adds encoded data as the newest slot, if there's room */
+static int append_slot(pl_rewind *rewind,
+                       const void *data,
+                       int size,
+                       unsigned char flags)
 {
-  rewind_state_t *save_slot = 
-    (rewind->current) ? rewind->current->next
-                      : rewind->start;
+  int offset;
 
-	if (!rewind->save_state(save_slot->data))
+  if (rewind->count >= rewind->state_count ||
+      (offset = alloc_data(rewind, size)) < 0)
     return 0;
 
-	rewind->current = save_slot;
+  rewind->head = (rewind->tail + rewind->count) % rewind->state_count;
+  rewind->count++;
+
+  rewind_state_t *save_slot = &rewind->slots[rewind->head];
+  save_slot->offset = offset;
+  save_slot->size = size;
+  save_slot->flags = flags;
+  memcpy(rewind->data + offset, data, size);
 
-  /* Move starting point forward, if we've reached the start node */
-  if (save_slot->next == rewind->start)
-    rewind->start = rewind->start->next;
+  /* Keeps paged keyframes' page tables int-aligned */
+  rewind->data_head = ALIGN4(offset + size);
+  rewind->memory_used += size;
 
   return 1;
 }
 
-int pl_rewind_restore(pl_rewind *rewind)
+static int stage_state(pl_rewind *rewind)
 {
-  rewind_state_t *load_slot = rewind->current;
-  if (!(load_slot && rewind->load_state(load_slot->data)))
+  /* Blocks only if the worker has fallen behind */
+  sceKernelWaitSema(rewind->free_sema, 1, NULL);
+
+  if (!rewind->save_state(rewind->staging[rewind->stage_in]))
+  {
+    sceKernelSignalSema(rewind->free_sema, 1);
     return 0;
+  }
 
-  /* Can't go past the starting point */
-  if (load_slot != rewind->start)
-    rewind->current = rewind->current->prev;
+  rewind->stage_in = (rewind->stage_in + 1) % PL_REWIND_STAGING_BUFFERS;
+  sceKernelSignalSema(rewind->staged_sema, 1);
+
+  /* An earlier snapshot was lost; this one is still staged */
+  return !__sync_lock_test_and_set(&rewind->worker_error, 0);
+}
 
+/* Waits until every staged snapshot is in the ring */
+static void flush_worker(pl_rewind *rewind)
+{
+  sceKernelWaitSema(rewind->free_sema, PL_REWIND_STAGING_BUFFERS, NULL);
+  sceKernelSignalSema(rewind->free_sema, PL_REWIND_STAGING_BUFFERS);
+}
+
+static int worker_thread(SceSize args, void *argp)
+{
+  pl_rewind *rewind = *(pl_rewind**)argp;
+
+  for (;;)
+  {
+    sceKernelWaitSema(rewind->staged_sema, 1, NULL);
+    if (rewind->worker_stop)
+      break;
+
+    /* On failure, last_state stays the base of the newest slot */
+    if (store_state(rewind, rewind->staging[rewind->stage_out]))
+      memcpy(rewind->last_state,
+             rewind->staging[rewind->stage_out],
+             rewind->state_data_size);
+    else
+      rewind->worker_error = 1;
+
+    rewind->stage_out = (rewind->stage_out + 1) % PL_REWIND_STAGING_BUFFERS;
+    sceKernelSignalSema(rewind->free_sema, 1);
+  }
+
+  sceKernelExitThread(0);
+  return 0;
+}
+
+/* Returns offset of a contiguous free region in the data ring, */
+/* or -1 if there isn't one                                     */
+static int alloc_data(const pl_rewind *rewind,
+                      int size)
+{
+  int end = rewind->data_head;
+  int oldest;
+
+  if (!rewind->count)
+    return (size <= rewind->memory_budget) ? 0 : -1;
+
+  oldest = rewind->slots[rewind->tail].offset;
+  if (end > oldest)
+  {
+    /* Free space at the end of the ring, then at the beginning */
+    if (end + size <= rewind->memory_budget)
+      return end;
+    return (size <= oldest) ? 0 : -1;
+  }
+
+  /* Ring has wrapped; free space lies between newest and oldest */
+  return (end + size <= oldest) ? end : -1;
+}
+
+static void release_oldest_group(pl_rewind *rewind)
+{
+  /* Deltas can't outlive the keyframe they're based on */
+  do
+  {
+    if (rewind->journal)
+      journal_push(rewind, &rewind->slots[rewind->tail]);
+
+    drop_slot(rewind, rewind->tail);
+    rewind->tail = NEXT_SLOT(rewind, rewind->tail);
+    rewind->count--;
+  } while (rewind->count &&
+           !(rewind->slots[rewind->tail].flags & REWIND_KEYFRAME));
+
+  if (!rewind->count)
+    clear_ring(rewind);
+}
+
+static int get_key_distance(const pl_rewind *rewind,
+                            int index)
+{
+  int distance;
+  for (distance = 0;
+       !(rewind->slots[index].flags & REWIND_KEYFRAME);
+       distance++)
+    index = PREV_SLOT(rewind, index);
+  return distance;
+}
+
+/* Releases a slot's data; the slot itself is left in the ring */
+static void drop_slot(pl_rewind *rewind,
+                      int index)
+{
+  const rewind_state_t *slot = &rewind->slots[index];
+
+  if (slot->flags & REWIND_PAGED)
+  {
+    const int *table = (const int*)(rewind->data + slot->offset);
+    int i;
+
+    for (i = 0; i < slot->size / (int)sizeof(int); i++)
+      unref_page(rewind, table[i]);
+  }
+
+  rewind->memory_used -= slot->size;
+}
+
+/* Encodes state into encode_buffer; returns encoded size. */
+/* 'stored' receives the bytes added to the page store     */
+static int encode_state(pl_rewind *rewind,
+                        const void *state,
+                        int keyframe,
+                        unsigned char *flags,
+                        int *stored)
+{
+  int size;
+
+  *stored = 0;
+  if (keyframe && rewind->page_count &&
+      (size = page_state(rewind, state, stored)) >= 0)
+  {
+    *flags = REWIND_KEYFRAME | REWIND_PAGED;
+    return size;
+  }
+
+  /* Page store is full (or disabled); store it inline */
+  return compress_state(rewind, state, keyframe, flags);
+}
+
+/* Encodes state into encode_buffer; returns encoded size */
+static int compress_state(pl_rewind *rewind,
+                          const void *state,
+                          int keyframe,
+                          unsigned char *flags)
+{
+  const void *base = (keyframe) ? NULL : rewind->last_state;
+  void *out = rewind->encode_buffer;
+  int size = rewind->state_data_size;
+
+  *flags = (keyframe) ? REWIND_KEYFRAME : 0;
+
+  int encoded = pl_delta_encode(base, state, size, out, size);
+  if (encoded >= 0)
+    return encoded;
+
+  /* Incompressible; store the XOR block as-is */
+  *flags |= REWIND_RAW;
+  memcpy(out, state, size);
+  if (base)
+    pl_delta_xor(out, base, size);
+
+  return size;
+}
+
+/* Returns 0 if a delta along the way is corrupt */
+static int rebuild_state(const pl_rewind *rewind,
+                         int index,
+                         void *state)
+{
+  int key;
+
+  /* Find the keyframe, then replay deltas up to the slot */
+  for (key = index;
+       !(rewind->slots[key].flags & REWIND_KEYFRAME);
+       key = PREV_SLOT(rewind, key));
+
+  memset(state, 0, rewind->state_data_size);
+  for (;; key = NEXT_SLOT(rewind, key))
+  {
+    if (!apply_slot(rewind, &rewind->slots[key], state))
+      return 0;
+    if (key == index) break;
+  }
+
+  return 1;
+}
+
+/* Returns 0 if the slot's delta is corrupt */
+static int apply_slot(const pl_rewind *rewind,
+                      const rewind_state_t *slot,
+                      void *state)
+{
+  const unsigned char *src = rewind->data + slot->offset;
+
+  if (slot->flags & REWIND_PAGED)
+  {
+    const int *table = (const int*)src;
+    unsigned char *dest = (unsigned char*)state;
+    int i, len, size = rewind->state_data_size;
+
+    for (i = 0; i < slot->size / (int)sizeof(int); i++)
+    {
+      len = MIN(PL_REWIND_PAGE_SIZE, size - i * PL_REWIND_PAGE_SIZE);
+      memcpy(dest + i * PL_REWIND_PAGE_SIZE,
+             PAGE_DATA(rewind, table[i]), len);
+    }
+  }
+  else if (slot->flags & REWIND_RAW)
+    pl_delta_xor(state, src, slot->size);
+  else
+    return pl_delta_apply(state, rewind->state_data_size, src, slot->size);
+
+  return 1;
+}
+
+static void clear_pages(pl_rewind *rewind)
+{
+  int i;
+
+  for (i = 0; i <= rewind->bucket_mask; i++)
+    rewind->buckets[i] = -1;
+  for (i = 0; i < rewind->page_count; i++)
+    rewind->pages[i].next = (i + 1 < rewind->page_count) ? i + 1 : -1;
+
+  rewind->free_page = (rewind->page_count) ? 0 : -1;
+  rewind->pages_used = 0;
+}
+
+/* Writes a table of page indices into encode_buffer; returns */
+/* table size, or -1 if the page store is full                */
+static int page_state(pl_rewind *rewind,
+                      const void *state,
+                      int *stored)
+{
+  const unsigned char *src = (const unsigned char*)state;
+  int *table = (int*)rewind->encode_buffer;
+  int size = rewind->state_data_size;
+  int i, len, pages = (size + PL_REWIND_PAGE_SIZE - 1) / PL_REWIND_PAGE_SIZE;
+
+  for (i = 0; i < pages; i++, src += PL_REWIND_PAGE_SIZE)
+  {
+    len = MIN(PL_REWIND_PAGE_SIZE, size - i * PL_REWIND_PAGE_SIZE);
+    if ((table[i] = ref_page(rewind, src, len, stored)) < 0)
+    {
+      /* Give back what was referenced so far */
+      while (i--)
+        unref_page(rewind, table[i]);
+      *stored = 0;
+      return -1;
+    }
+  }
+
+  return pages * sizeof(int);
+}
+
+/* Returns index of a stored page matching src, adding one if */
+/* necessary. Returns -1 if there's no room                   */
+static int ref_page(pl_rewind *rewind,
+                   const unsigned char *src,
+                   int len,
+                   int *stored)
+{
+  unsigned int hash = hash_page(src, len);
+  int *bucket = &rewind->buckets[hash & rewind->bucket_mask];
+  rewind_page_t *page;
+  int index;
+
+  for (index = *bucket; index >= 0; index = page->next)
+  {
+    page = &rewind->pages[index];
+    if (page->hash == hash && !memcmp(PAGE_DATA(rewind, index), src, len))
+    {
+      page->refs++;
+      return index;
+    }
+  }
+
+  if ((index = rewind->free_page) < 0)
+    return -1;
+
+  page = &rewind->pages[index];
+  rewind->free_page = page->next;
+
+  page->hash = hash;
+  page->refs = 1;
+  page->next = *bucket;
+  *bucket = index;
+
+  /* Partial (last) page is zero-padded */
+  memcpy(PAGE_DATA(rewind, index), src, len);
+  if (len < PL_REWIND_PAGE_SIZE)
+    memset(PAGE_DATA(rewind, index) + len, 0, PL_REWIND_PAGE_SIZE - len);
+
+  rewind->pages_used++;
+  *stored += PL_REWIND_PAGE_SIZE;
+
+  return index;
+}
+
+static void unref_page(pl_rewind *rewind,
+                       int index)
+{
+  rewind_page_t *page = &rewind->pages[index];
+  int *link;
+
+  if (--page->refs > 0)
+    return;
+
+  /* Unlink from the hash chain, then free */
+  for (link = &rewind->buckets[page->hash & rewind->bucket_mask];
+       *link != index;
+       link = &rewind->pages[*link].next);
+  *link = page->next;
+
+  page->next = rewind->free_page;
+  rewind->free_page = index;
+  rewind->pages_used--;
+}
+
+/* FNV-1a over 32-bit words, in four independent lanes */
+static unsigned int hash_page(const unsigned char *src,
+                              int len)
+{
+  unsigned int h[4] = { 2166136261u, 2166136261u, 2166136261u, 2166136261u };
+  unsigned int w[4];
+  int i, j;
+
+  for (i = 0; i + 16 <= len; i += 16)
+  {
+    memcpy(w, src + i, 16);
+    for (j = 0; j < 4; j++)
+      h[j] = (h[j] ^ w[j]) * 16777619u;
+  }
+  for (; i < len; i++)
+    h[0] = (h[0] ^ src[i]) * 16777619u;
+
+  /* Mix high bits down; only the low ones select a bucket */
+  h[0] = ((h[0] * 31 + h[1]) * 31 + h[2]) * 31 + h[3];
+  h[0] ^= h[0] >> 16;
+  h[0] *= 0x7feb352du;
+  h[0] ^= h[0] >> 15;
+
+  return h[0];
+}
+
+static int open_journal(pl_rewind *rewind,
+                        const char *path)
+{
+  rewind_journal_t *journal;
+  pl_file_path parent;
+
+  /* If the journal's directory does not exist, create it */
+  pl_file_get_parent_directory(path, parent, sizeof(parent));
+  if (parent[0] && !pl_file_exists(parent))
+    if (!pl_file_mkdir_recursive(parent))
+      return 0;
+
+  if (!(journal = (rewind_journal_t*)calloc(1, sizeof(rewind_journal_t))))
+    return 0;
+
+  /* Write blocks and the readahead window share one allocation */
+  if (!(journal->blocks[0] = (unsigned char*)memalign(16,
+          PL_REWIND_JOURNAL_BLOCK * (JOURNAL_BUFFERS + 1))))
+  {
+    free(journal);
+    return 0;
+  }
+
+  journal->blocks[1] = journal->blocks[0] + PL_REWIND_JOURNAL_BLOCK;
+  journal->cache = journal->blocks[0]
+                   + PL_REWIND_JOURNAL_BLOCK * JOURNAL_BUFFERS;
+  strncpy(journal->path, path, sizeof(journal->path) - 1);
+
+  journal->fd = sceIoOpen(path, SCE_O_RDWR | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+  journal->full_sema = sceKernelCreateSema("rewind_jfull", 0, 0,
+                                           JOURNAL_BUFFERS, NULL);
+  journal->empty_sema = sceKernelCreateSema("rewind_jempty", 0,
+                                            JOURNAL_BUFFERS,
+                                            JOURNAL_BUFFERS, NULL);
+  journal->thread = sceKernelCreateThread("rewind_journal",
+                                          journal_thread,
+                                          0x10000100, 0x4000,
+                                          0, 0, NULL);
+
+  if (journal->fd < 0 ||
+      journal->full_sema < 0 ||
+      journal->empty_sema < 0 ||
+      journal->thread < 0 ||
+      sceKernelStartThread(journal->thread,
+                           sizeof(journal), &journal) < 0)
+  {
+    if (journal->thread >= 0)
+      sceKernelDeleteThread(journal->thread);
+    if (journal->full_sema >= 0)
+      sceKernelDeleteSema(journal->full_sema);
+    if (journal->empty_sema >= 0)
+      sceKernelDeleteSema(journal->empty_sema);
+    if (journal->fd >= 0)
+    {
+      sceIoClose(journal->fd);
+      pl_file_rm(path);
+    }
+
+    free(journal->blocks[0]);
+    free(journal);
+    return 0;
+  }
+
+  rewind->journal = journal;
   return 1;
 }
 
+static void close_journal(pl_rewind *rewind)
+{
+  rewind_journal_t *journal = rewind->journal;
+
+  journal_flush(journal);
+  journal->stop = 1;
+  sceKernelSignalSema(journal->full_sema, 1);
+  sceKernelWaitThreadEnd(journal->thread, NULL, NULL);
+  sceKernelDeleteThread(journal->thread);
+  sceKernelDeleteSema(journal->full_sema);
+  sceKernelDeleteSema(journal->empty_sema);
+
+  sceIoClose(journal->fd);
+  pl_file_rm(journal->path);
+
+  free(journal->blocks[0]);
+  free(journal);
+  rewind->journal = NULL;
+}
+
+static void journal_push(pl_rewind *rewind,
+                         const rewind_state_t *slot)
+{
+  rewind_journal_t *journal = rewind->journal;
+  rewind_record_t record;
+
+  record.size = slot->size;
+  record.flags = slot->flags;
+
+  /* Paged keyframes are written out in full */
+  if (slot->flags & REWIND_PAGED)
+  {
+    record.size = rewind->state_data_size;
+    record.flags = REWIND_KEYFRAME | REWIND_RAW;
+  }
+
+  /* File contents are about to change */
+  journal->cache_len = 0;
+
+  journal_append(journal, &record, sizeof(record));
+  if (slot->flags & REWIND_PAGED)
+  {
+    const int *table = (const int*)(rewind->data + slot->offset);
+    int i;
+
+    for (i = 0; i < slot->size / (int)sizeof(int); i++)
+      journal_append(journal, PAGE_DATA(rewind, table[i]),
+                     MIN(PL_REWIND_PAGE_SIZE,
+                         record.size - i * PL_REWIND_PAGE_SIZE));
+  }
+  else
+    journal_append(journal, rewind->data + slot->offset, slot->size);
+  journal_append(journal, &record, sizeof(record));
+  journal->records++;
+}
+
+static void journal_append(rewind_journal_t *journal,
+                           const void *data,
+                           int len)
+{
+  const unsigned char *src = (const unsigned char*)data;
+  int chunk;
+
+  while (len > 0)
+  {
+    if (!journal->filling)
+    {
+      /* Blocks only if the writer is a full block behind */
+      sceKernelWaitSema(journal->empty_sema, 1, NULL);
+      journal->filling = 1;
+      journal->block_len[journal->fill] = 0;
+      journal->block_offset[journal->fill] = journal->size;
+    }
+
+    chunk = MIN(len, PL_REWIND_JOURNAL_BLOCK
+                     - journal->block_len[journal->fill]);
+    memcpy(journal->blocks[journal->fill] + journal->block_len[journal->fill],
+           src, chunk);
+
+    journal->block_len[journal->fill] += chunk;
+    journal->size += chunk;
+    src += chunk;
+    len -= chunk;
+
+    if (journal->block_len[journal->fill] >= PL_REWIND_JOURNAL_BLOCK)
+      journal_submit(journal);
+  }
+}
+
+static void journal_submit(rewind_journal_t *journal)
+{
+  journal->filling = 0;
+  journal->fill = (journal->fill + 1) % JOURNAL_BUFFERS;
+  sceKernelSignalSema(journal->full_sema, 1);
+}
+
+/* Writes out any partial block and waits for the writer */
+static void journal_flush(rewind_journal_t *journal)
+{
+  if (journal->filling)
+    journal_submit(journal);
+
+  sceKernelWaitSema(journal->empty_sema, JOURNAL_BUFFERS, NULL);
+  sceKernelSignalSema(journal->empty_sema, JOURNAL_BUFFERS);
+
+  /* A failed write leaves a hole; give up on what's there */
+  if (journal->error)
+  {
+    journal->size = 0;
+    journal->records = 0;
+    journal->cache_len = 0;
+    journal->error = 0;
+  }
+}
+
+/* Reads are served from a window that extends backwards from */
+/* the end of the request, since the journal is replayed in    */
+/* reverse                                                     */
+static int journal_read(rewind_journal_t *journal,
+                        int offset,
+                        void *dest,
+                        int len)
+{
+  int start, end = offset + len;
+
+  if (offset >= journal->cache_offset &&
+      end <= journal->cache_offset + journal->cache_len)
+  {
+    memcpy(dest, journal->cache + (offset - journal->cache_offset), len);
+    return 1;
+  }
+
+  if (len > PL_REWIND_JOURNAL_BLOCK)
+    return sceIoLseek(journal->fd, offset, SCE_SEEK_SET) == offset &&
+           sceIoRead(journal->fd, dest, len) == len;
+
+  start = end - PL_REWIND_JOURNAL_BLOCK;
+  if (start < 0) start = 0;
+
+  journal->cache_len = 0;
+  if (sceIoLseek(journal->fd, start, SCE_SEEK_SET) != start ||
+      sceIoRead(journal->fd, journal->cache, end - start) != end - start)
+    return 0;
+
+  journal->cache_offset = start;
+  journal->cache_len = end - start;
+  memcpy(dest, journal->cache + (offset - start), len);
+
+  return 1;
+}
+
+/* Replaces the contents of the ring with the newest keyframe */
+/* group in the journal, and rebuilds last_state from it.      */
+/* Returns 0 if the journal is empty or found to be broken; a  */
+/* broken journal is discarded, and the ring is left holding   */
+/* whatever part of the group was replayed before the failure  */
+static int pop_journal_group(pl_rewind *rewind)
+{
+  rewind_journal_t *journal = rewind->journal;
+  rewind_record_t record;
+  int offset, start, count, total, i;
+
+  journal_flush(journal);
+  if (!journal->records)
+    return 0;
+
+  /* Walk back to the group's keyframe */
+  for (offset = journal->size, count = 0, total = 0; ; )
+  {
+    if (offset < (int)sizeof(record) * 2 ||
+        !journal_read(journal, offset - sizeof(record),
+                      &record, sizeof(record)) ||
+        record.size < 0 || record.size > rewind->state_data_size)
+      goto broken;
+
+    offset -= record.size + sizeof(record) * 2;
+    count++;
+
+    /* The whole group must fit before the ring is given up; */
+    /* appended from an empty ring, slots never wrap          */
+    total += ALIGN4(record.size);
+
+    if (offset < 0 || count > rewind->state_count ||
+        total > rewind->memory_budget)
+      goto broken;
+    if (record.flags & REWIND_KEYFRAME)
+      break;
+    if (count >= journal->records)
+      goto broken;
+  }
+
+  /* Replay the group into the ring, oldest first */
+  for (i = 0, start = offset; i < count; i++)
+  {
+    if (!journal_read(journal, offset, &record, sizeof(record)) ||
+        record.size < 0 || record.size > rewind->state_data_size ||
+        !journal_read(journal, offset + sizeof(record),
+                      rewind->encode_buffer, record.size))
+      break;
+
+    /* Ring is only discarded once the keyframe is in hand */
+    if (i == 0)
+      clear_ring(rewind);
+
+    if (!append_slot(rewind, rewind->encode_buffer,
+                     record.size, record.flags))
+      break;
+
+    offset += record.size + sizeof(record) * 2;
+  }
+
+  if (i > 0 && !rebuild_state(rewind, rewind->head, rewind->last_state))
+    clear_ring(rewind);
+  if (i < count)
+    goto broken;
+
+  journal->size = start;
+  journal->records -= count;
+  return 1;
+
+broken:
+  journal->size = 0;
+  journal->records = 0;
+  return 0;
+}
+
+static int journal_thread(SceSize args, void *argp)
+{
+  rewind_journal_t *journal = *(rewind_journal_t**)argp;
+  int i;
+
+  for (;;)
+  {
+    sceKernelWaitSema(journal->full_sema, 1, NULL);
+    if (journal->stop)
+      break;
+
+    i = journal->flush_next;
+    if (sceIoLseek(journal->fd, journal->block_offset[i], SCE_SEEK_SET)
+          != journal->block_offset[i] ||
+        sceIoWrite(journal->fd, journal->blocks[i], journal->block_len[i])
+          != journal->block_len[i])
+      journal->error = 1;
+
+    journal->flush_next = (i + 1) % JOURNAL_BUFFERS;
+    sceKernelSignalSema(journal->empty_sema, 1);
+  }
+
+  sceKernelExitThread(0);
+  return 0;
+}
+
 static int get_free_memory()
 {
-  const int 
+  const int
     chunk_size = 65536, // 64 kB
     chunks = 1024; // 65536 * 1024 = 64 MB
   void *mem_reserv[chunks];
   int total_mem = 0, i;
 
-  /* Initialize */	
+  /* Initialize */
   for (i = 0; i < chunks; i++)
     mem_reserv[i] = NULL;
 
@@ -189,7 +1567,6 @@ static int get_free_memory()
       break;
     free(mem_reserv[i]);
   }
-	
-	return total_mem;
-}
 
+  return total_mem;
+}
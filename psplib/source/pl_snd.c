@@ -20,40 +20,198 @@
 */
 
 #include "pl_snd.h"
+#include "pl_snd_backend.h"
+#include "pl_dsp.h"
+#include "pl_resample.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <malloc.h>
+#ifdef __vita__
 #include <psp2/kernel/processmgr.h>
 #include <psp2/kernel/threadmgr.h>
-#include <psp2/kernel/sysmem.h>
-#include <psp2/audioout.h>
-#include <psp2/io/fcntl.h>
+#include <psp2/rtc.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
 #define AUDIO_CHANNELS  1
 #define DEFAULT_SAMPLES 512
 #define VOLUME_MAX      0x8000
+#define QUEUE_PERIODS   8 /* Minimum queue length, in output buffers */
+#define MAX_SAMPLES     65472 /* Largest buffer accepted by a port */
+#define CONVERT_FRAMES  256 /* Staging for channel conversion, in frames */
+#define CAPTURE_RING    0x40000 /* Capture buffering, in bytes; power of 2 */
+#define CAPTURE_CHUNK   0x10000 /* Largest single capture write */
+#define CAPTURE_POLL_MS 20
+
+#ifdef __vita__
+typedef SceUID pl_snd_thread;
+#define DEFAULT_BACKEND pl_snd_sce_backend
+#else
+typedef pthread_t pl_snd_thread;
+#define DEFAULT_BACKEND pl_snd_null_backend
+#endif
 
 static int sound_ready;
 static volatile int sound_stop;
+static volatile int config_lock; /* Held while a config change is made */
+static const pl_snd_backend *backend = &DEFAULT_BACKEND;
+
+typedef struct {
+  pl_snd_callback callback;
+  void *user_data;
+  short gain_l; /* Q15 */
+  short gain_r;
+  pl_resampler *resampler; /* NULL if voice runs at the output rate */
+  int rate;
+  int mode;
+  /* Rate control holds the queue at target_fill input samples */
+  unsigned int target_fill; /* 0 if disabled */
+  float fill_avg;
+  int playing; /* Filled the last buffer; audio thread only */
+  unsigned int dither_seed; /* Used by the producer */
+  /* Set by pl_snd_set_voice_rate() and pl_snd_set_rate_control(); */
+  /* the audio thread swaps them in, and frees the old resampler   */
+  int pending_rate;
+  int pending_mode;
+  unsigned int pending_target_fill;
+  pl_resampler *pending_resampler;
+  int pending_change;
+  /* Single-producer, single-consumer queue for pl_snd_write(). */
+  /* Indices run freely and are masked on access                 */
+  unsigned char *queue;
+  unsigned int queue_size; /* In samples; power of 2 */
+  volatile unsigned int queue_head; /* Written by producer only */
+  volatile unsigned int queue_tail; /* Written by audio thread only */
+} pl_snd_voice;
+
+/* Updated by the audio thread; times are in get_ticks() units */
+typedef struct {
+  unsigned int buffers;
+  unsigned int underruns;
+  unsigned int late_buffers;
+  unsigned int overruns; /* Updated by the producer */
+  uint64_t render_ticks;
+  uint64_t render_min;
+  uint64_t render_max;
+  uint64_t blocked_ticks;
+  uint64_t blocked_max;
+  unsigned int fill[PL_SND_FILL_HISTORY];
+  unsigned int fill_next;
+} pl_snd_counters;
+
+/* Copies of the mixed output, drained to a .wav file by a writer */
+/* thread; the audio thread never waits on storage               */
+typedef struct {
+  pl_snd_wav_backend wav;
+  int port;
+  pl_snd_thread thread;
+  unsigned char *ring;
+  volatile unsigned int head; /* Written by audio thread only */
+  volatile unsigned int tail; /* Written by writer only */
+  unsigned int dropped; /* Bytes that didn't fit */
+  volatile int active;  /* Audio thread fills the ring while set */
+  volatile int stop_request; /* Cleared by audio thread on stopping */
+  volatile int stop;    /* Writer drains the ring and exits */
+} pl_snd_capture;
 
 typedef struct {
-  int thread_handle;
+  pl_snd_thread thread;
+  int thread_started;
   int sound_ch_handle;
   int left_vol;
   int right_vol;
-  pl_snd_callback callback;
-  void *user_data;
-  short *sample_buffer[2];
-  unsigned int samples[2];
+  int port_left_vol;  /* Last volume set on the port, or -1 */
+  int port_right_vol;
+  /* Software gain (Q30), applied to the mixed buffer */
+  int fade_gain;
+  int fade_target;
+  unsigned int fade_frames; /* Left until fade_target is reached */
+  int pending_fade_target;  /* Set by pl_snd_fade() */
+  unsigned int pending_fade_frames;
+  volatile int fade_request;
+  short *sample_buffer[PL_SND_MAX_BUFFERS];
+  short *mix_buffer; /* Voices are rendered here, then mixed */
+  unsigned int samples[PL_SND_MAX_BUFFERS];
+  unsigned int buffer_count;
+  int rate; /* Of the port */
+  /* Set under the config lock, applied by the audio thread */
+  unsigned int pending_count;
+  unsigned int pending_samples;
+  int pending_stereo;
+  int pending_rate;
+  volatile unsigned int config_request; /* Bumped for each change */
+  volatile unsigned int config_done;    /* Last request applied */
+  volatile int config_result;
+  pl_snd_counters counters;
+  volatile int reset_counters;
+  pl_snd_capture capture;
   unsigned char paused;
   unsigned char stereo;
+  pl_snd_voice voices[PL_SND_VOICES];
 } pl_snd_channel_info;
 
 static pl_snd_channel_info sound_stream[AUDIO_CHANNELS];
 
-static int channel_thread(int args, void *argp);
+static void channel_thread(int channel);
+static void capture_thread(int channel);
+static void capture_buffer(int channel,
+                           const void *buf,
+                           unsigned int bytes);
+static int start_thread(int channel);
+static void stop_thread(int channel);
+static uint64_t get_ticks();
+static uint64_t get_tick_rate();
 static void free_buffers();
 static unsigned int get_bytes_per_sample(int channel);
+static int render_voice(int channel,
+                        pl_snd_voice *voice,
+                        void *buf,
+                        unsigned int samples);
+static unsigned int fetch_voice(int channel,
+                                pl_snd_voice *voice,
+                                void *buf,
+                                unsigned int samples);
+static unsigned int read_queue(int channel,
+                               pl_snd_voice *voice,
+                               void *buf,
+                               unsigned int samples);
+static pl_snd_voice* get_voice(int channel,
+                               int voice);
+static void convert_frames(int channel,
+                           void *dest,
+                           const void *src,
+                           unsigned int frames,
+                           int format,
+                           int stereo,
+                           unsigned int *seed);
+static void apply_config(int channel);
+static void apply_fade(int channel,
+                       void *buf,
+                       unsigned int samples);
+static void update_counters(int channel,
+                            uint64_t render_ticks,
+                            uint64_t blocked_ticks,
+                            unsigned int samples);
+static void lock_config();
+static void unlock_config();
+static int request_config(int channel);
+static int change_voice(int channel,
+                        pl_snd_voice *voice,
+                        int rate,
+                        int mode,
+                        unsigned int target_fill);
+static void apply_voice_change(pl_snd_voice *voice);
+static int create_resampler(int in_rate,
+                            int mode,
+                            int controlled,
+                            int out_rate,
+                            int stereo,
+                            pl_resampler **resampler);
+static void destroy_resampler(pl_resampler *resampler);
+static void control_rate(pl_snd_voice *voice);
 static inline int play_blocking(unsigned int channel,
                                 unsigned int vol1,
                                 unsigned int vol2,
@@ -63,6 +221,12 @@ int pl_snd_init(int sample_count,
                 int stereo)
 {
   int i, j, failed;
+  pl_snd_voice *voice;
+
+  /* Restarting; release the current ports and thread(s) first */
+  if (sound_ready)
+    pl_snd_shutdown();
+
   sound_stop = 0;
   sound_ready = 0;
 
@@ -76,15 +240,49 @@ int pl_snd_init(int sample_count,
   {
     ch_info = &sound_stream[i];
     ch_info->sound_ch_handle = -1;
-    ch_info->thread_handle = -1;
+    ch_info->thread_started = 0;
     ch_info->left_vol = VOLUME_MAX;
     ch_info->right_vol = VOLUME_MAX;
-    ch_info->callback = NULL;
-    ch_info->user_data = NULL;
+    ch_info->port_left_vol = -1;
+    ch_info->port_right_vol = -1;
+    ch_info->fade_gain = PL_DSP_RAMP_UNITY;
+    ch_info->fade_target = PL_DSP_RAMP_UNITY;
+    ch_info->fade_frames = 0;
+    ch_info->fade_request = 0;
     ch_info->paused = 1;
     ch_info->stereo = stereo;
+    ch_info->mix_buffer = NULL;
+    ch_info->buffer_count = PL_SND_MIN_BUFFERS;
+    ch_info->rate = PL_SND_OUTPUT_RATE;
+    ch_info->config_request = 0;
+    ch_info->config_done = 0;
+    ch_info->reset_counters = 1;
+    ch_info->capture.active = 0;
+    ch_info->capture.ring = NULL;
+
+    for (j = 0; j < PL_SND_VOICES; j++)
+    {
+      voice = &ch_info->voices[j];
+      voice->callback = NULL;
+      voice->user_data = NULL;
+      voice->gain_l = PL_DSP_GAIN_UNITY;
+      voice->gain_r = PL_DSP_GAIN_UNITY;
+      voice->resampler = NULL;
+      voice->rate = PL_SND_OUTPUT_RATE;
+      voice->mode = PL_RESAMPLE_SINC;
+      voice->target_fill = 0;
+      voice->fill_avg = 0;
+      voice->playing = 0;
+      voice->dither_seed = 0x9e3779b9 * (j + 1);
+      voice->pending_resampler = NULL;
+      voice->pending_change = 0;
+      voice->queue = NULL;
+      voice->queue_size = 0;
+      voice->queue_head = 0;
+      voice->queue_tail = 0;
+    }
 
-    for (j = 0; j < 2; j++)
+    for (j = 0; j < PL_SND_MAX_BUFFERS; j++)
     {
       ch_info->sample_buffer[j] = NULL;
       ch_info->samples[j] = 0;
@@ -95,7 +293,7 @@ int pl_snd_init(int sample_count,
   for (i = 0; i < AUDIO_CHANNELS; i++)
   {
     ch_info = &sound_stream[i];
-    for (j = 0; j < 2; j++)
+    for (j = 0; j < ch_info->buffer_count; j++)
     {
       if (!(ch_info->sample_buffer[j] =
               (short*)malloc(sample_count * get_bytes_per_sample(i))))
@@ -106,6 +304,31 @@ int pl_snd_init(int sample_count,
 
       ch_info->samples[j] = sample_count;
     }
+
+    if (!(ch_info->mix_buffer =
+            (short*)malloc(sample_count * get_bytes_per_sample(i))))
+    {
+      free_buffers();
+      return 0;
+    }
+
+    for (j = 0; j < PL_SND_VOICES; j++)
+    {
+      voice = &ch_info->voices[j];
+      for (voice->queue_size = 1;
+           voice->queue_size < sample_count * QUEUE_PERIODS;
+           voice->queue_size <<= 1);
+
+      /* Sized for stereo, so the channel can be reconfigured */
+      /* without reallocating queues under the producer       */
+      if (!(voice->queue =
+              (unsigned char*)malloc(voice->queue_size
+                                     * sizeof(pl_snd_stereo_sample))))
+      {
+        free_buffers();
+        return 0;
+      }
+    }
   }
 
 
@@ -113,11 +336,8 @@ int pl_snd_init(int sample_count,
   for (i = 0, failed = 0; i < AUDIO_CHANNELS; i++)
   {
     sound_stream[i].sound_ch_handle =
-      sceAudioOutOpenPort(SCE_AUDIO_OUT_PORT_TYPE_MAIN,
-                        sample_count, 48000,
-                        (stereo)
-                          ? SCE_AUDIO_OUT_MODE_STEREO
-                          : SCE_AUDIO_OUT_MODE_MONO);
+      backend->open(backend->data, sample_count,
+                    sound_stream[i].rate, stereo);
 
     if (sound_stream[i].sound_ch_handle < 0)
     {
@@ -132,7 +352,7 @@ int pl_snd_init(int sample_count,
     {
       if (sound_stream[i].sound_ch_handle != -1)
       {
-        sceAudioOutReleasePort(sound_stream[i].sound_ch_handle);
+        backend->release(backend->data, sound_stream[i].sound_ch_handle);
         sound_stream[i].sound_ch_handle = -1;
       }
     }
@@ -143,22 +363,9 @@ int pl_snd_init(int sample_count,
 
   sound_ready = 1;
 
-  char label[16];
-  strcpy(label, "audiotX");
-
   for (i = 0; i < AUDIO_CHANNELS; i++)
   {
-    label[6] = '0' + i;
-    sound_stream[i].thread_handle =
-    sceKernelCreateThread(label, (void*)&channel_thread, 0x10000100, 0x10000, 0, 0, NULL);
-    if (sound_stream[i].thread_handle < 0)
-    {
-      sound_stream[i].thread_handle = -1;
-      failed = 1;
-      break;
-    }
-
-    if (sceKernelStartThread(sound_stream[i].thread_handle, sizeof(i), &i) != 0)
+    if (!start_thread(i))
     {
       failed = 1;
       break;
@@ -169,17 +376,15 @@ int pl_snd_init(int sample_count,
   {
     sound_stop = 1;
     for (i = 0; i < AUDIO_CHANNELS; i++)
-    {
-      if (sound_stream[i].thread_handle != -1)
-      {
-        //sceKernelWaitThreadEnd(sound_stream[i].threadhandle,NULL);
-        sceKernelDeleteThread(sound_stream[i].thread_handle);
-      }
+      stop_thread(i);
 
-      sound_stream[i].thread_handle = -1;
+    sound_ready = 0;
+    for (i = 0; i < AUDIO_CHANNELS; i++)
+    {
+      backend->release(backend->data, sound_stream[i].sound_ch_handle);
+      sound_stream[i].sound_ch_handle = -1;
     }
 
-    sound_ready = 0;
     free_buffers();
     return 0;
   }
@@ -190,25 +395,23 @@ int pl_snd_init(int sample_count,
 void pl_snd_shutdown()
 {
   int i;
+
+  /* Capture needs the audio thread to stop cleanly */
+  for (i = 0; i < AUDIO_CHANNELS; i++)
+    pl_snd_stop_capture(i);
+
   sound_ready = 0;
   sound_stop = 1;
 
+  /* Threads must be gone before their ports and buffers are */
   for (i = 0; i < AUDIO_CHANNELS; i++)
-  {
-    if (sound_stream[i].thread_handle != -1)
-    {
-      //sceKernelWaitThreadEnd(sound_stream[i].threadhandle,NULL);
-      sceKernelDeleteThread(sound_stream[i].thread_handle);
-    }
-
-    sound_stream[i].thread_handle = -1;
-  }
+    stop_thread(i);
 
   for (i = 0; i < AUDIO_CHANNELS; i++)
   {
     if (sound_stream[i].sound_ch_handle != -1)
     {
-      sceAudioOutReleasePort(sound_stream[i].sound_ch_handle);
+      backend->release(backend->data, sound_stream[i].sound_ch_handle);
       sound_stream[i].sound_ch_handle = -1;
     }
   }
@@ -216,53 +419,258 @@ void pl_snd_shutdown()
   free_buffers();
 }
 
-static int channel_thread(int args, void *argp)
+/* Selects where output goes; only while sound is shut down */
+int pl_snd_set_backend(const pl_snd_backend *new_backend)
+{
+  if (sound_ready)
+    return 0;
+  backend = (new_backend) ? new_backend : &DEFAULT_BACKEND;
+  return 1;
+}
+
+#ifdef __vita__
+
+typedef struct
+{
+  void (*func)(int);
+  int arg;
+} thread_args;
+
+static int thread_entry(SceSize args, void *argp)
+{
+  thread_args *ta = (thread_args*)argp;
+  ta->func(ta->arg);
+  sceKernelExitThread(0);
+  return 0;
+}
+
+static int create_thread(pl_snd_thread *thread,
+                         const char *name,
+                         void (*func)(int),
+                         int arg)
+{
+  thread_args ta = { func, arg };
+
+  if ((*thread = sceKernelCreateThread(name, thread_entry,
+                                       0x10000100, 0x10000, 0, 0, NULL)) < 0)
+    return 0;
+
+  /* Arguments are copied to the new thread's stack */
+  if (sceKernelStartThread(*thread, sizeof(ta), &ta) != 0)
+  {
+    sceKernelDeleteThread(*thread);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void join_thread(pl_snd_thread *thread)
+{
+  sceKernelWaitThreadEnd(*thread, NULL, NULL);
+  sceKernelDeleteThread(*thread);
+}
+
+static void sleep_ms(int ms)
+{
+  sceKernelDelayThread(ms * 1000);
+}
+
+static uint64_t get_ticks()
+{
+  uint64_t tick;
+  sceRtcGetCurrentTick(&tick);
+  return tick;
+}
+
+static uint64_t get_tick_rate()
+{
+  return sceRtcGetTickResolution();
+}
+
+#else
+
+typedef struct
+{
+  void (*func)(int);
+  int arg;
+} thread_args;
+
+static void* thread_entry(void *arg)
+{
+  thread_args ta = *(thread_args*)arg;
+  free(arg);
+  ta.func(ta.arg);
+  return NULL;
+}
+
+static int create_thread(pl_snd_thread *thread,
+                         const char *name,
+                         void (*func)(int),
+                         int arg)
+{
+  thread_args *ta;
+
+  if (!(ta = (thread_args*)malloc(sizeof(thread_args))))
+    return 0;
+  ta->func = func;
+  ta->arg = arg;
+
+  if (pthread_create(thread, NULL, thread_entry, ta) != 0)
+  {
+    free(ta);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void join_thread(pl_snd_thread *thread)
+{
+  pthread_join(*thread, NULL);
+}
+
+static void sleep_ms(int ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
+
+static uint64_t get_ticks()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t get_tick_rate()
+{
+  return 1000000;
+}
+
+#endif
+
+static int start_thread(int channel)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  char label[16];
+
+  strcpy(label, "audiotX");
+  label[6] = '0' + channel;
+
+  if (!create_thread(&ch_info->thread, label, channel_thread, channel))
+    return 0;
+
+  ch_info->thread_started = 1;
+  return 1;
+}
+
+/* Thread exits after its current buffer once sound_stop is set */
+static void stop_thread(int channel)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+
+  if (ch_info->thread_started)
+  {
+    join_thread(&ch_info->thread);
+    ch_info->thread_started = 0;
+  }
+}
+
+static void channel_thread(int channel)
 {
   volatile int bufidx = 0;
-  int channel = *(int*)argp;
   int i, j;
-  unsigned short *ptr_m;
-  unsigned int *ptr_s;
   void *bufptr;
-  unsigned int samples;
-  pl_snd_callback callback;
+  unsigned int samples, bytes;
+  int mixed;
+  uint64_t start, rendered, played;
+  pl_snd_voice *voice;
   pl_snd_channel_info *ch_info;
 
   ch_info = &sound_stream[channel];
-  for (j = 0; j < 2; j++)
+  for (j = 0; j < ch_info->buffer_count; j++)
     memset(ch_info->sample_buffer[j], 0,
            ch_info->samples[j] * get_bytes_per_sample(channel));
 
   while (!sound_stop)
   {
-    callback = ch_info->callback;
+    if (ch_info->config_request != ch_info->config_done)
+    {
+      apply_config(channel);
+      bufidx = 0;
+    }
+
+    if (ch_info->capture.stop_request)
+    {
+      ch_info->capture.active = 0;
+      __sync_synchronize();
+      ch_info->capture.stop_request = 0;
+    }
+
+    if (ch_info->reset_counters)
+    {
+      memset(&ch_info->counters, 0, sizeof(pl_snd_counters));
+      ch_info->counters.render_min = (uint64_t)-1;
+      ch_info->reset_counters = 0;
+    }
+
+    start = get_ticks();
     bufptr = ch_info->sample_buffer[bufidx];
     samples = ch_info->samples[bufidx];
+    bytes = samples * get_bytes_per_sample(channel);
 
-    if (callback && !ch_info->paused)
-      /* Use callback to fill buffer */
-      callback(bufptr, samples, ch_info->user_data);
-    else
+    for (i = 0, mixed = 0; i < PL_SND_VOICES && !ch_info->paused; i++)
     {
-      /* Fill buffer with silence */
-      if (ch_info->stereo)
-        for (i = 0, ptr_s = bufptr; i < samples; i++) *(ptr_s++) = 0;
-      else
-        for (i = 0, ptr_m = bufptr; i < samples; i++) *(ptr_m++) = 0;
+      voice = &ch_info->voices[i];
+
+      /* First voice at unity gain renders straight to output */
+      if (!mixed &&
+          voice->gain_l == PL_DSP_GAIN_UNITY &&
+          voice->gain_r == PL_DSP_GAIN_UNITY)
+      {
+        mixed = render_voice(channel, voice, bufptr, samples);
+        continue;
+      }
+
+      if (!render_voice(channel, voice, ch_info->mix_buffer, samples))
+        continue;
+
+      if (!mixed)
+      {
+        memset(bufptr, 0, bytes);
+        mixed = 1;
+      }
+
+      pl_dsp_mix_s16(bufptr, ch_info->mix_buffer,
+                     (ch_info->stereo) ? samples * 2 : samples,
+                     voice->gain_l, voice->gain_r);
     }
 
+    /* Fill buffer with silence */
+    if (!mixed)
+      memset(bufptr, 0, bytes);
+    else
+      apply_fade(channel, bufptr, samples);
+
+    if (ch_info->capture.active)
+      capture_buffer(channel, bufptr, bytes);
+
     /* Play sound */
+    rendered = get_ticks();
 	  play_blocking(channel,
                   ch_info->left_vol,
                   ch_info->right_vol,
                   bufptr);
+    played = get_ticks();
+
+    update_counters(channel, rendered - start, played - rendered, samples);
 
     /* Switch active buffer */
-    bufidx = (bufidx ? 0 : 1);
+    bufidx = (bufidx + 1) % ch_info->buffer_count;
   }
-
-  sceKernelExitThread(0);
-  return 0;
 }
 
 static inline int play_blocking(unsigned int channel,
@@ -272,9 +680,180 @@ static inline int play_blocking(unsigned int channel,
 {
   if (!sound_ready) return -1;
   if (channel >= AUDIO_CHANNELS) return -1;
-  int vols[2]={vol1,vol2};
-  sceAudioOutSetVolume(sound_stream[channel].sound_ch_handle,SCE_AUDIO_VOLUME_FLAG_L_CH|SCE_AUDIO_VOLUME_FLAG_R_CH,vols);
-  return sceAudioOutOutput(sound_stream[channel].sound_ch_handle, buf);
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+
+  /* Volume only goes to the port when it changes */
+  if (vol1 != ch_info->port_left_vol || vol2 != ch_info->port_right_vol)
+  {
+    backend->set_volume(backend->data, ch_info->sound_ch_handle, vol1, vol2);
+    ch_info->port_left_vol = vol1;
+    ch_info->port_right_vol = vol2;
+  }
+
+  return backend->output(backend->data, ch_info->sound_ch_handle, buf);
+}
+
+/* Starts recording the channel's output (after fades, before */
+/* port volume) to a .wav file at path                         */
+int pl_snd_start_capture(int channel,
+                         const char *path)
+{
+  pl_snd_channel_info *ch_info;
+  pl_snd_capture *capture;
+
+  if (!sound_ready || channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+
+  ch_info = &sound_stream[channel];
+  capture = &ch_info->capture;
+  if (capture->ring)
+    return 0;
+
+  if (!(capture->ring = (unsigned char*)malloc(CAPTURE_RING)))
+    return 0;
+
+  if (!pl_snd_wav_backend_init(&capture->wav, path, 0))
+  {
+    free(capture->ring);
+    capture->ring = NULL;
+    return 0;
+  }
+
+  if ((capture->port = capture->wav.backend.open(capture->wav.backend.data,
+                                                 CAPTURE_CHUNK
+                                                   / get_bytes_per_sample(channel),
+                                                 ch_info->rate,
+                                                 ch_info->stereo)) < 0)
+    goto error;
+
+  capture->head = capture->tail = 0;
+  capture->dropped = 0;
+  capture->stop = 0;
+  capture->stop_request = 0;
+
+  if (!create_thread(&capture->thread, "audiocap", capture_thread, channel))
+    goto error;
+
+  /* Ring must be ready before the audio thread uses it */
+  __sync_synchronize();
+  capture->active = 1;
+
+  return 1;
+
+error:
+  pl_snd_wav_backend_destroy(&capture->wav);
+  free(capture->ring);
+  capture->ring = NULL;
+  return 0;
+}
+
+/* Stops recording; returns once the file is complete */
+int pl_snd_stop_capture(int channel)
+{
+  pl_snd_capture *capture;
+
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+
+  capture = &sound_stream[channel].capture;
+  if (!capture->ring)
+    return 0;
+
+  /* Wait for the audio thread to let go of the ring */
+  capture->stop_request = 1;
+  while (sound_ready && capture->stop_request)
+    sleep_ms(1);
+  capture->active = 0;
+
+  __sync_synchronize();
+  capture->stop = 1;
+  join_thread(&capture->thread);
+
+  pl_snd_wav_backend_destroy(&capture->wav);
+  free(capture->ring);
+  capture->ring = NULL;
+
+  return 1;
+}
+
+/* Bytes lost because the writer couldn't keep up */
+unsigned int pl_snd_get_capture_dropped(int channel)
+{
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+  return sound_stream[channel].capture.dropped;
+}
+
+/* Runs on the audio thread; drops the buffer if it doesn't fit */
+static void capture_buffer(int channel,
+                           const void *buf,
+                           unsigned int bytes)
+{
+  pl_snd_capture *capture = &sound_stream[channel].capture;
+  unsigned int head = capture->head;
+  unsigned int index, chunk;
+
+  if (bytes > CAPTURE_RING - (head - capture->tail))
+  {
+    capture->dropped += bytes;
+    return;
+  }
+
+  index = head & (CAPTURE_RING - 1);
+  chunk = CAPTURE_RING - index;
+  if (chunk > bytes)
+    chunk = bytes;
+
+  memcpy(capture->ring + index, buf, chunk);
+  memcpy(capture->ring, (const unsigned char*)buf + chunk, bytes - chunk);
+
+  /* Data must land before the writer sees the new head */
+  __sync_synchronize();
+  capture->head = head + bytes;
+}
+
+static void capture_thread(int channel)
+{
+  pl_snd_capture *capture = &sound_stream[channel].capture;
+  const pl_snd_backend *wav = &capture->wav.backend;
+  unsigned int bpf = get_bytes_per_sample(channel);
+  unsigned int tail, available, index, stop;
+
+  for (;;)
+  {
+    stop = capture->stop;
+    __sync_synchronize();
+
+    tail = capture->tail;
+    available = capture->head - tail;
+
+    /* Let data accumulate, to keep writes large */
+    if (available < CAPTURE_CHUNK && !stop)
+    {
+      sleep_ms(CAPTURE_POLL_MS);
+      continue;
+    }
+
+    /* Head must be read before the data it covers */
+    __sync_synchronize();
+
+    if (!available)
+      break;
+
+    index = tail & (CAPTURE_RING - 1);
+    if (available > CAPTURE_RING - index)
+      available = CAPTURE_RING - index;
+    if (available > CAPTURE_CHUNK)
+      available = CAPTURE_CHUNK;
+    available -= available % bpf;
+
+    wav->set_config(wav->data, capture->port, available / bpf, -1, -1);
+    wav->output(wav->data, capture->port, capture->ring + index);
+
+    /* Done reading before the space is handed back */
+    __sync_synchronize();
+    capture->tail = tail + available;
+  }
 }
 
 static void free_buffers()
@@ -285,7 +864,7 @@ static void free_buffers()
   for (i = 0; i < AUDIO_CHANNELS; i++)
   {
     ch_info = &sound_stream[i];
-    for (j = 0; j < 2; j++)
+    for (j = 0; j < PL_SND_MAX_BUFFERS; j++)
     {
       if (ch_info->sample_buffer[j])
       {
@@ -293,6 +872,29 @@ static void free_buffers()
         ch_info->sample_buffer[j] = NULL;
       }
     }
+
+    if (ch_info->mix_buffer)
+    {
+      free(ch_info->mix_buffer);
+      ch_info->mix_buffer = NULL;
+    }
+
+    for (j = 0; j < PL_SND_VOICES; j++)
+    {
+      if (ch_info->voices[j].queue)
+      {
+        free(ch_info->voices[j].queue);
+        ch_info->voices[j].queue = NULL;
+      }
+
+      destroy_resampler(ch_info->voices[j].resampler);
+      ch_info->voices[j].resampler = NULL;
+
+      /* Audio thread stopped before it could swap it in */
+      destroy_resampler(ch_info->voices[j].pending_resampler);
+      ch_info->voices[j].pending_resampler = NULL;
+      ch_info->voices[j].pending_change = 0;
+    }
   }
 }
 
@@ -300,31 +902,654 @@ int pl_snd_set_callback(int channel,
                         pl_snd_callback callback,
                         void *userdata)
 {
-  if (channel < 0 || channel > AUDIO_CHANNELS)
+  return pl_snd_set_voice_callback(channel, 0, callback, userdata);
+}
+
+int pl_snd_set_voice_callback(int channel,
+                              int voice,
+                              pl_snd_callback callback,
+                              void *userdata)
+{
+  volatile pl_snd_voice *pv = get_voice(channel, voice);
+  if (!pv)
     return 0;
-  volatile pl_snd_channel_info *pci = &sound_stream[channel];
-  pci->callback = NULL;
-  pci->user_data = userdata;
-  pci->callback = callback;
+  pv->callback = NULL;
+  pv->user_data = userdata;
+  pv->callback = callback;
 
   return 1;
 }
 
-static unsigned int get_bytes_per_sample(int channel)
+/* Gain is 0.0 - 1.0; pan runs from -1.0 (left) to 1.0 (right) */
+int pl_snd_set_voice_gain(int channel,
+                          int voice,
+                          float gain,
+                          float pan)
 {
-  return (sound_stream[channel].stereo)
-    ? sizeof(pl_snd_stereo_sample)
-    : sizeof(pl_snd_mono_sample);
-}
+  pl_snd_voice *pv = get_voice(channel, voice);
+  float left, right;
 
-int pl_snd_pause(int channel)
-{
-  if (channel < 0 || channel > AUDIO_CHANNELS)
+  if (!pv)
     return 0;
-  sound_stream[channel].paused = 1;
+
+  if (gain < 0) gain = 0;
+  else if (gain > 1.0f) gain = 1.0f;
+  if (pan < -1.0f) pan = -1.0f;
+  else if (pan > 1.0f) pan = 1.0f;
+
+  /* Mono channels ignore pan */
+  left = right = gain;
+  if (sound_stream[channel].stereo)
+  {
+    if (pan > 0) left *= 1.0f - pan;
+    else right *= 1.0f + pan;
+  }
+
+  pv->gain_l = (short)(left * PL_DSP_GAIN_UNITY);
+  pv->gain_r = (short)(right * PL_DSP_GAIN_UNITY);
+
   return 1;
 }
 
+/* Sets the rate at which the voice's callback or queue supplies */
+/* samples; blocks until the audio thread has made the change.   */
+/* Must not be called from a voice callback                      */
+int pl_snd_set_voice_rate(int channel,
+                          int voice,
+                          int rate,
+                          int mode)
+{
+  pl_snd_voice *pv = get_voice(channel, voice);
+  int ok;
+
+  if (!pv || rate <= 0)
+    return 0;
+
+  lock_config();
+  ok = change_voice(channel, pv, rate, mode, pv->target_fill);
+  unlock_config();
+
+  return ok;
+}
+
+/* Lets the audio thread stretch or squeeze a queued voice by up */
+/* to PL_SND_MAX_SKEW, to keep latency_ms worth of samples in    */
+/* the queue despite clock drift. 0 disables. Blocks like        */
+/* pl_snd_set_voice_rate()                                       */
+int pl_snd_set_rate_control(int channel,
+                            int voice,
+                            int latency_ms)
+{
+  pl_snd_voice *pv = get_voice(channel, voice);
+  unsigned int target_fill;
+  int ok;
+
+  if (!pv || latency_ms < 0)
+    return 0;
+
+  lock_config();
+
+  target_fill = (unsigned int)((int64_t)pv->rate * latency_ms / 1000);
+  if (target_fill > pv->queue_size)
+    target_fill = pv->queue_size;
+  ok = change_voice(channel, pv, pv->rate, pv->mode, target_fill);
+
+  unlock_config();
+
+  return ok;
+}
+
+/* Config changes are made one at a time; whoever holds the lock */
+/* owns the pending fields until the audio thread is done        */
+static void lock_config()
+{
+  while (__sync_lock_test_and_set(&config_lock, 1))
+    sleep_ms(1);
+}
+
+static void unlock_config()
+{
+  __sync_lock_release(&config_lock);
+}
+
+/* Hands the channel's pending settings to the audio thread and */
+/* waits until they're applied. Call with the config lock held  */
+static int request_config(int channel)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  unsigned int request;
+
+  /* Settings must be visible before the request */
+  __sync_synchronize();
+  request = ++ch_info->config_request;
+
+  while (sound_ready && (int)(ch_info->config_done - request) < 0)
+    sleep_ms(1);
+
+  return sound_ready && ch_info->config_result;
+}
+
+/* Creates the resampler the new settings need and has the audio */
+/* thread swap it in. Call with the config lock held             */
+static int change_voice(int channel,
+                        pl_snd_voice *voice,
+                        int rate,
+                        int mode,
+                        unsigned int target_fill)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  pl_resampler *rs;
+
+  /* Channel's rate and layout can't change while the lock is held */
+  if (!create_resampler(rate, mode, target_fill != 0,
+                        ch_info->rate, ch_info->stereo, &rs))
+    return 0;
+
+  voice->pending_rate = rate;
+  voice->pending_mode = mode;
+  voice->pending_target_fill = target_fill;
+  voice->pending_resampler = rs;
+  voice->pending_change = 1;
+
+  /* No audio thread to race with */
+  if (!sound_ready)
+  {
+    apply_voice_change(voice);
+    return 1;
+  }
+
+  /* Leave the rest of the channel as it is */
+  ch_info->pending_count = ch_info->buffer_count;
+  ch_info->pending_samples = ch_info->samples[0];
+  ch_info->pending_stereo = ch_info->stereo;
+  ch_info->pending_rate = ch_info->rate;
+
+  return request_config(channel);
+}
+
+/* Runs on the audio thread, unless it isn't running */
+static void apply_voice_change(pl_snd_voice *voice)
+{
+  destroy_resampler(voice->resampler);
+  voice->resampler = voice->pending_resampler;
+  voice->rate = voice->pending_rate;
+  voice->mode = voice->pending_mode;
+  voice->target_fill = voice->pending_target_fill;
+  voice->fill_avg = voice->target_fill;
+  voice->pending_resampler = NULL;
+  voice->pending_change = 0;
+}
+
+/* A resampler is needed if the voice isn't at the output rate,  */
+/* or if its rate is being controlled. Sets *resampler to NULL   */
+/* if the voice doesn't need one                                 */
+static int create_resampler(int in_rate,
+                            int mode,
+                            int controlled,
+                            int out_rate,
+                            int stereo,
+                            pl_resampler **resampler)
+{
+  pl_resampler *rs = NULL;
+
+  if (in_rate != out_rate || controlled)
+  {
+    if (!(rs = (pl_resampler*)malloc(sizeof(pl_resampler))))
+      return 0;
+    if (!pl_resample_init(rs, in_rate, out_rate, stereo, mode))
+    {
+      free(rs);
+      return 0;
+    }
+  }
+
+  *resampler = rs;
+  return 1;
+}
+
+static void destroy_resampler(pl_resampler *resampler)
+{
+  if (resampler)
+  {
+    pl_resample_destroy(resampler);
+    free(resampler);
+  }
+}
+
+/* Nudges the resampling ratio in proportion to how far the */
+/* (smoothed) queue fill is from the target                 */
+static void control_rate(pl_snd_voice *voice)
+{
+  float fill = voice->queue_head - voice->queue_tail;
+  float error;
+
+  voice->fill_avg += (fill - voice->fill_avg) * 0.125f;
+  error = (voice->fill_avg - voice->target_fill) / voice->target_fill;
+
+  if (error > 1.0f) error = 1.0f;
+  else if (error < -1.0f) error = -1.0f;
+
+  /* Fuller than target: consume input faster */
+  pl_resample_set_skew(voice->resampler, error * PL_SND_MAX_SKEW);
+}
+
+/* Changes the number of output buffers and their size, so   */
+/* that buffer_count buffers cover roughly latency_ms; blocks */
+/* until the change is made. Returns the new buffer size in   */
+/* samples, or 0 on error                                     */
+int pl_snd_set_buffering(int buffer_count,
+                         int latency_ms)
+{
+  pl_snd_channel_info *ch_info;
+  int64_t frames;
+  int i, samples = 0;
+
+  if (!sound_ready ||
+      buffer_count < PL_SND_MIN_BUFFERS ||
+      buffer_count > PL_SND_MAX_BUFFERS ||
+      latency_ms <= 0)
+    return 0;
+
+  lock_config();
+
+  for (i = 0; i < AUDIO_CHANNELS; i++)
+  {
+    ch_info = &sound_stream[i];
+
+    /* Rate can't change while the lock is held */
+    frames = (int64_t)latency_ms * ch_info->rate / 1000 / buffer_count;
+    if (frames > MAX_SAMPLES)
+      frames = MAX_SAMPLES;
+    samples = PL_SND_ALIGN_SAMPLE((int)frames);
+
+    ch_info->pending_count = buffer_count;
+    ch_info->pending_samples = samples;
+    ch_info->pending_stereo = ch_info->stereo;
+    ch_info->pending_rate = ch_info->rate;
+
+    if (!request_config(i))
+      break;
+  }
+
+  unlock_config();
+
+  return (i == AUDIO_CHANNELS) ? samples : 0;
+}
+
+/* Estimated time (ms) before a sample written to voice 0 */
+/* now is heard. Must not be called from a voice callback */
+float pl_snd_get_latency(int channel)
+{
+  pl_snd_channel_info *ch_info;
+  pl_snd_voice *voice;
+  float pending;
+  int rest;
+
+  if (!(voice = get_voice(channel, 0)))
+    return 0;
+
+  ch_info = &sound_stream[channel];
+
+  /* Waiting in the queue or the resampler, at the voice's rate; */
+  /* the lock keeps the audio thread from freeing the resampler  */
+  lock_config();
+  pending = voice->queue_head - voice->queue_tail;
+  if (voice->resampler)
+    pending += voice->resampler->buffered;
+  pending = pending * ch_info->rate / voice->rate;
+  unlock_config();
+
+  /* Buffer being rendered, plus whatever the port has left */
+  pending += ch_info->samples[0];
+  if ((rest = backend->get_rest(backend->data, ch_info->sound_ch_handle)) > 0)
+    pending += rest;
+
+  return pending * 1000.0f / ch_info->rate;
+}
+
+int pl_snd_get_stats(int channel,
+                     pl_snd_stats *stats)
+{
+  const pl_snd_counters *counters;
+  float ticks_per_ms = (float)get_tick_rate() / 1000.0f;
+  int i, count;
+
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+
+  /* Counters are read without locking; values are approximate */
+  counters = &sound_stream[channel].counters;
+
+  stats->buffers = counters->buffers;
+  stats->underruns = counters->underruns;
+  stats->late_buffers = counters->late_buffers;
+  stats->overruns = counters->overruns;
+
+  if (counters->buffers)
+  {
+    stats->render_min_ms = (float)counters->render_min / ticks_per_ms;
+    stats->render_avg_ms = (float)counters->render_ticks
+                           / counters->buffers / ticks_per_ms;
+    stats->render_max_ms = (float)counters->render_max / ticks_per_ms;
+    stats->blocked_avg_ms = (float)counters->blocked_ticks
+                            / counters->buffers / ticks_per_ms;
+    stats->blocked_max_ms = (float)counters->blocked_max / ticks_per_ms;
+  }
+  else
+  {
+    stats->render_min_ms = stats->render_avg_ms = stats->render_max_ms = 0;
+    stats->blocked_avg_ms = stats->blocked_max_ms = 0;
+  }
+
+  count = (counters->fill_next < PL_SND_FILL_HISTORY)
+          ? counters->fill_next : PL_SND_FILL_HISTORY;
+  for (i = 0; i < count; i++)
+    stats->fill[i] = counters->fill[(counters->fill_next - count + i)
+                                    % PL_SND_FILL_HISTORY];
+  stats->fill_count = count;
+
+  return 1;
+}
+
+/* Counters are cleared by the audio thread, before its next buffer */
+int pl_snd_reset_stats(int channel)
+{
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+  sound_stream[channel].reset_counters = 1;
+  return 1;
+}
+
+static void update_counters(int channel,
+                            uint64_t render_ticks,
+                            uint64_t blocked_ticks,
+                            unsigned int samples)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  pl_snd_counters *counters = &ch_info->counters;
+  pl_snd_voice *voice = &ch_info->voices[0];
+
+  counters->buffers++;
+  counters->render_ticks += render_ticks;
+  if (render_ticks < counters->render_min)
+    counters->render_min = render_ticks;
+  if (render_ticks > counters->render_max)
+    counters->render_max = render_ticks;
+
+  counters->blocked_ticks += blocked_ticks;
+  if (blocked_ticks > counters->blocked_max)
+    counters->blocked_max = blocked_ticks;
+
+  /* Rendering took longer than the buffer lasts */
+  if (render_ticks * ch_info->rate
+        > (uint64_t)samples * get_tick_rate())
+    counters->late_buffers++;
+
+  counters->fill[counters->fill_next++ % PL_SND_FILL_HISTORY] =
+    voice->queue_head - voice->queue_tail;
+}
+
+/* Changes buffer size, layout and rate of all channels without */
+/* stopping the audio thread(s); blocks until the change is made. */
+/* If the layout or rate changes, queued samples are dropped.     */
+/* Returns the new buffer size in samples, or 0 on error          */
+int pl_snd_reconfigure(int samples,
+                       int stereo,
+                       int rate)
+{
+  pl_snd_channel_info *ch_info;
+  int i;
+
+  if (!sound_ready || samples <= 0 || rate <= 0)
+    return 0;
+
+  samples = PL_SND_ALIGN_SAMPLE(samples);
+  if (samples > MAX_SAMPLES)
+    samples = MAX_SAMPLES;
+  stereo = (stereo != 0);
+
+  lock_config();
+
+  for (i = 0; i < AUDIO_CHANNELS; i++)
+  {
+    ch_info = &sound_stream[i];
+
+    /* Format of a capture file is fixed */
+    if (ch_info->capture.ring &&
+        (stereo != ch_info->stereo || rate != ch_info->rate))
+      break;
+
+    ch_info->pending_count = ch_info->buffer_count;
+    ch_info->pending_samples = samples;
+    ch_info->pending_stereo = stereo;
+    ch_info->pending_rate = rate;
+
+    if (!request_config(i))
+      break;
+  }
+
+  unlock_config();
+
+  return (i == AUDIO_CHANNELS) ? samples : 0;
+}
+
+/* Runs on the audio thread, between buffers */
+static void apply_config(int channel)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  unsigned int request = ch_info->config_request;
+  unsigned int count, samples, bps;
+  int stereo, rate, format_changed, ok;
+  short *buffers[PL_SND_MAX_BUFFERS], *mix = NULL;
+  pl_resampler *resamplers[PL_SND_VOICES];
+  pl_snd_voice *voice;
+  int i, j = 0;
+
+  /* Request must be read before the settings */
+  __sync_synchronize();
+  count = ch_info->pending_count;
+  samples = ch_info->pending_samples;
+  stereo = ch_info->pending_stereo;
+  rate = ch_info->pending_rate;
+  bps = (stereo) ? sizeof(pl_snd_stereo_sample) : sizeof(pl_snd_mono_sample);
+  format_changed = (stereo != ch_info->stereo || rate != ch_info->rate);
+
+  /* Nothing else can be using the voices' resamplers here */
+  for (i = 0; i < PL_SND_VOICES; i++)
+    if (ch_info->voices[i].pending_change)
+      apply_voice_change(&ch_info->voices[i]);
+
+  ok = 1;
+  if (count == ch_info->buffer_count && samples == ch_info->samples[0] &&
+      !format_changed)
+    goto done;
+
+  /* Allocate first; keep current setup on failure */
+  for (i = 0; i < count; i++)
+    if (!(buffers[i] = (short*)calloc(samples, bps)))
+      break;
+
+  if (i == count)
+    mix = (short*)malloc(samples * bps);
+
+  if (mix && format_changed)
+    for (; j < PL_SND_VOICES; j++)
+    {
+      voice = &ch_info->voices[j];
+      if (!create_resampler(voice->rate, voice->mode,
+                            voice->target_fill != 0, rate, stereo,
+                            &resamplers[j]))
+        break;
+    }
+
+  ok = mix && (!format_changed || j == PL_SND_VOICES);
+
+  /* Port can't be reconfigured (and the last buffer can't be */
+  /* freed) until the last buffer has finished playing        */
+  if (ok)
+  {
+    backend->output(backend->data, ch_info->sound_ch_handle, NULL);
+    ok = backend->set_config(backend->data, ch_info->sound_ch_handle,
+                             samples,
+                             (format_changed) ? rate : -1,
+                             (format_changed) ? stereo : -1) >= 0;
+  }
+
+  if (!ok)
+  {
+    while (i--)
+      free(buffers[i]);
+    while (j--)
+      destroy_resampler(resamplers[j]);
+    free(mix);
+    goto done;
+  }
+
+  for (i = 0; i < PL_SND_MAX_BUFFERS; i++)
+  {
+    free(ch_info->sample_buffer[i]);
+    ch_info->sample_buffer[i] = (i < count) ? buffers[i] : NULL;
+    ch_info->samples[i] = (i < count) ? samples : 0;
+  }
+
+  free(ch_info->mix_buffer);
+  ch_info->mix_buffer = mix;
+  ch_info->buffer_count = count;
+
+  if (format_changed)
+  {
+    for (j = 0; j < PL_SND_VOICES; j++)
+    {
+      voice = &ch_info->voices[j];
+      destroy_resampler(voice->resampler);
+      voice->resampler = resamplers[j];
+
+      /* Queued samples are in the old layout */
+      if (stereo != ch_info->stereo)
+        voice->queue_tail = voice->queue_head;
+    }
+
+    ch_info->stereo = stereo;
+    ch_info->rate = rate;
+  }
+
+done:
+  ch_info->config_result = ok;
+  __sync_synchronize();
+  ch_info->config_done = request;
+}
+
+static pl_snd_voice* get_voice(int channel,
+                               int voice)
+{
+  if (channel < 0 || channel >= AUDIO_CHANNELS ||
+      voice < 0 || voice >= PL_SND_VOICES)
+    return NULL;
+  return &sound_stream[channel].voices[voice];
+}
+
+static unsigned int get_bytes_per_sample(int channel)
+{
+  return (sound_stream[channel].stereo)
+    ? sizeof(pl_snd_stereo_sample)
+    : sizeof(pl_snd_mono_sample);
+}
+
+int pl_snd_pause(int channel)
+{
+  if (channel < 0 || channel > AUDIO_CHANNELS)
+    return 0;
+  sound_stream[channel].paused = 1;
+  return 1;
+}
+
+/* Sets the port volume (0 - 0x8000); applied with the next buffer */
+int pl_snd_set_volume(int channel,
+                      int left,
+                      int right)
+{
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+  if (left < 0) left = 0;
+  else if (left > VOLUME_MAX) left = VOLUME_MAX;
+  if (right < 0) right = 0;
+  else if (right > VOLUME_MAX) right = VOLUME_MAX;
+
+  sound_stream[channel].left_vol = left;
+  sound_stream[channel].right_vol = right;
+  return 1;
+}
+
+/* Ramps the channel's software gain (0.0 - 1.0) to 'gain' over */
+/* duration_ms, sample by sample, e.g. for pause fades          */
+int pl_snd_fade(int channel,
+                float gain,
+                int duration_ms)
+{
+  pl_snd_channel_info *ch_info;
+
+  if (channel < 0 || channel >= AUDIO_CHANNELS || duration_ms < 0)
+    return 0;
+  if (gain < 0) gain = 0;
+  else if (gain > 1.0f) gain = 1.0f;
+
+  ch_info = &sound_stream[channel];
+  ch_info->pending_fade_target = (int)(gain * PL_DSP_RAMP_UNITY);
+  ch_info->pending_fade_frames =
+    (unsigned int)((int64_t)duration_ms * ch_info->rate / 1000);
+
+  /* Settings must be visible before the request */
+  __sync_synchronize();
+  ch_info->fade_request = 1;
+
+  return 1;
+}
+
+/* Runs on the audio thread */
+static void apply_fade(int channel,
+                       void *buf,
+                       unsigned int samples)
+{
+  pl_snd_channel_info *ch_info = &sound_stream[channel];
+  int channels = (ch_info->stereo) ? 2 : 1;
+  unsigned int frames;
+  int step;
+
+  if (ch_info->fade_request)
+  {
+    ch_info->fade_request = 0;
+    ch_info->fade_target = ch_info->pending_fade_target;
+    ch_info->fade_frames = ch_info->pending_fade_frames;
+    if (!ch_info->fade_frames)
+      ch_info->fade_gain = ch_info->fade_target;
+  }
+
+  /* Nothing to do at unity */
+  if (!ch_info->fade_frames && ch_info->fade_gain == PL_DSP_RAMP_UNITY)
+    return;
+
+  if (ch_info->fade_frames)
+  {
+    frames = (samples < ch_info->fade_frames) ? samples : ch_info->fade_frames;
+    step = (ch_info->fade_target - ch_info->fade_gain)
+           / (int)ch_info->fade_frames;
+
+    pl_dsp_ramp_s16(buf, frames, channels, ch_info->fade_gain, step);
+    ch_info->fade_gain += step * (int)frames;
+    ch_info->fade_frames -= frames;
+
+    /* Land exactly on the target */
+    if (!ch_info->fade_frames)
+      ch_info->fade_gain = ch_info->fade_target;
+
+    buf = (short*)buf + frames * channels;
+    samples -= frames;
+  }
+
+  if (samples)
+    pl_dsp_ramp_s16(buf, samples, channels, ch_info->fade_gain, 0);
+}
+
 int pl_snd_resume(int channel)
 {
   if (channel < 0 || channel > AUDIO_CHANNELS)
@@ -332,3 +1557,276 @@ int pl_snd_resume(int channel)
   sound_stream[channel].paused = 0;
   return 1;
 }
+
+/* Queues samples for playback by the audio thread; returns */
+/* number of samples accepted, which is less than count if  */
+/* the queue is full. Must be called from a single thread   */
+unsigned int pl_snd_write(int channel,
+                          const pl_snd_sample *samples,
+                          unsigned int count)
+{
+  return pl_snd_write_voice(channel, 0, samples, count);
+}
+
+unsigned int pl_snd_write_voice(int channel,
+                                int voice,
+                                const pl_snd_sample *samples,
+                                unsigned int count)
+{
+  if (channel < 0 || channel >= AUDIO_CHANNELS)
+    return 0;
+  return pl_snd_write_voice_format(channel, voice, samples, count,
+                                   PL_SND_FORMAT_S16,
+                                   sound_stream[channel].stereo);
+}
+
+/* Like pl_snd_write_voice(), but for count frames of any format */
+/* and channel count; samples are converted to the channel's     */
+/* format as they're queued                                      */
+unsigned int pl_snd_write_voice_format(int channel,
+                                       int voice,
+                                       const void *samples,
+                                       unsigned int count,
+                                       int format,
+                                       int stereo)
+{
+  pl_snd_voice *pv = get_voice(channel, voice);
+  unsigned int head, space, index, chunk, bps, src_bpf;
+
+  if (!pv || !pv->queue)
+    return 0;
+
+  switch (format)
+  {
+  case PL_SND_FORMAT_S16: src_bpf = sizeof(short); break;
+  case PL_SND_FORMAT_S32: src_bpf = sizeof(int); break;
+  case PL_SND_FORMAT_F32: src_bpf = sizeof(float); break;
+  default: return 0;
+  }
+
+  if (stereo) src_bpf *= 2;
+  stereo = (stereo != 0);
+  bps = get_bytes_per_sample(channel);
+  head = pv->queue_head;
+  space = pv->queue_size - (head - pv->queue_tail);
+  if (count > space)
+  {
+    count = space;
+    sound_stream[channel].counters.overruns++;
+  }
+
+  /* Convert in up to two pieces, if the queue wraps */
+  index = head & (pv->queue_size - 1);
+  chunk = pv->queue_size - index;
+  if (chunk > count)
+    chunk = count;
+
+  convert_frames(channel, pv->queue + index * bps, samples, chunk,
+                 format, stereo, &pv->dither_seed);
+  convert_frames(channel, pv->queue,
+                 (const unsigned char*)samples + chunk * src_bpf,
+                 count - chunk, format, stereo, &pv->dither_seed);
+
+  /* Samples must land before the audio thread sees the new head */
+  __sync_synchronize();
+  pv->queue_head = head + count;
+
+  return count;
+}
+
+/* Returns number of samples waiting to be played */
+unsigned int pl_snd_get_queued(int channel)
+{
+  return pl_snd_get_voice_queued(channel, 0);
+}
+
+unsigned int pl_snd_get_voice_queued(int channel,
+                                     int voice)
+{
+  pl_snd_voice *pv = get_voice(channel, voice);
+  return (pv) ? pv->queue_head - pv->queue_tail : 0;
+}
+
+unsigned int pl_snd_get_queue_size(int channel)
+{
+  pl_snd_voice *pv = get_voice(channel, 0);
+  return (pv) ? pv->queue_size : 0;
+}
+
+/* Fills buf from the voice's callback or queue; returns 0 if */
+/* the voice has nothing to play                              */
+static int render_voice(int channel,
+                        pl_snd_voice *voice,
+                        void *buf,
+                        unsigned int samples)
+{
+  pl_resampler *rs = voice->resampler;
+  unsigned int produced, count, needed, space, bps;
+  short *input;
+
+  if (!voice->callback && voice->queue_head == voice->queue_tail)
+  {
+    /* A stream that ran dry is an underrun; one that ended isn't */
+    if (voice->playing)
+      sound_stream[channel].counters.underruns++;
+    voice->playing = 0;
+
+    /* Keep tracking the fill, so the rate recovers when data resumes */
+    if (rs && voice->target_fill)
+      control_rate(voice);
+    return 0;
+  }
+
+  voice->playing = 1;
+  bps = get_bytes_per_sample(channel);
+  if (!rs)
+    produced = fetch_voice(channel, voice, buf, samples);
+  else
+  {
+    if (voice->target_fill && !voice->callback)
+      control_rate(voice);
+
+    /* Feed the resampler only as much input as it needs */
+    for (produced = 0; produced < samples; produced += count)
+    {
+      needed = pl_resample_get_needed(rs, samples - produced);
+      input = pl_resample_get_input(rs, &space);
+      if (needed > space)
+        needed = space;
+      if (needed)
+        pl_resample_commit(rs, fetch_voice(channel, voice, input, needed));
+
+      if (!(count = pl_resample_process(rs,
+              (short*)((unsigned char*)buf + produced * bps),
+              samples - produced)))
+        break;
+    }
+  }
+
+  /* Pad with silence on underrun */
+  if (produced < samples)
+  {
+    memset((unsigned char*)buf + produced * bps, 0, (samples - produced) * bps);
+    sound_stream[channel].counters.underruns++;
+    voice->playing = 0;
+  }
+
+  return 1;
+}
+
+/* Reads up to 'samples' samples from the voice's callback or queue */
+static unsigned int fetch_voice(int channel,
+                                pl_snd_voice *voice,
+                                void *buf,
+                                unsigned int samples)
+{
+  pl_snd_callback callback = voice->callback;
+
+  if (callback)
+  {
+    /* Use callback to fill buffer */
+    callback(buf, samples, voice->user_data);
+    return samples;
+  }
+
+  return read_queue(channel, voice, buf, samples);
+}
+
+/* Writes frames of the given format to dest, in the channel's */
+static void convert_frames(int channel,
+                           void *dest,
+                           const void *src,
+                           unsigned int frames,
+                           int format,
+                           int stereo,
+                           unsigned int *seed)
+{
+  short staging[CONVERT_FRAMES * 2];
+  int src_channels = (stereo) ? 2 : 1;
+  int dest_stereo = sound_stream[channel].stereo;
+  unsigned int chunk;
+  const short *s16;
+
+  /* Same layout: convert (or copy) straight into the queue */
+  if (stereo == dest_stereo)
+  {
+    switch (format)
+    {
+    case PL_SND_FORMAT_S16:
+      memcpy(dest, src, frames * src_channels * sizeof(short));
+      break;
+    case PL_SND_FORMAT_S32:
+      pl_dsp_s32_to_s16((short*)dest, (const int*)src,
+                        frames * src_channels, seed);
+      break;
+    case PL_SND_FORMAT_F32:
+      pl_dsp_f32_to_s16((short*)dest, (const float*)src,
+                        frames * src_channels, seed);
+      break;
+    }
+    return;
+  }
+
+  /* Otherwise, up/down-mix in pieces, via staging if need be */
+  for (; frames > 0; frames -= chunk)
+  {
+    chunk = (frames < CONVERT_FRAMES) ? frames : CONVERT_FRAMES;
+
+    switch (format)
+    {
+    case PL_SND_FORMAT_S16:
+      s16 = (const short*)src;
+      src = s16 + chunk * src_channels;
+      break;
+    case PL_SND_FORMAT_S32:
+      pl_dsp_s32_to_s16(staging, (const int*)src, chunk * src_channels, seed);
+      src = (const int*)src + chunk * src_channels;
+      s16 = staging;
+      break;
+    default:
+      pl_dsp_f32_to_s16(staging, (const float*)src, chunk * src_channels, seed);
+      src = (const float*)src + chunk * src_channels;
+      s16 = staging;
+      break;
+    }
+
+    if (dest_stereo)
+      pl_dsp_mono_to_stereo_s16((short*)dest, s16, chunk);
+    else
+      pl_dsp_stereo_to_mono_s16((short*)dest, s16, chunk);
+
+    dest = (short*)dest + chunk * ((dest_stereo) ? 2 : 1);
+  }
+}
+
+static unsigned int read_queue(int channel,
+                               pl_snd_voice *voice,
+                               void *buf,
+                               unsigned int samples)
+{
+  unsigned int tail, available, index, chunk, bps;
+
+  bps = get_bytes_per_sample(channel);
+  tail = voice->queue_tail;
+  available = voice->queue_head - tail;
+  if (available > samples)
+    available = samples;
+
+  /* Head must be read before the samples it covers */
+  __sync_synchronize();
+
+  index = tail & (voice->queue_size - 1);
+  chunk = voice->queue_size - index;
+  if (chunk > available)
+    chunk = available;
+
+  memcpy(buf, voice->queue + index * bps, chunk * bps);
+  memcpy((unsigned char*)buf + chunk * bps, voice->queue,
+         (available - chunk) * bps);
+
+  /* Done reading before the space is handed back */
+  __sync_synchronize();
+  voice->queue_tail = tail + available;
+
+  return available;
+}
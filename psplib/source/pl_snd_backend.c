@@ -0,0 +1,456 @@
+/* psplib/pl_snd_backend.c
+   Audio output backends for pl_snd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __vita__
+#include <psp2/kernel/processmgr.h>
+#include <psp2/kernel/threadmgr.h>
+#include <psp2/audioout.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "pl_snd_backend.h"
+
+#define WAV_HEADER_SIZE 44
+
+typedef struct
+{
+  int used;
+  int samples;
+  int rate;
+  int stereo;
+  unsigned long long start;  /* Time (us) the clock was started */
+  unsigned long long queued; /* Samples queued since start */
+} null_port;
+
+static null_port null_ports[PL_SND_BACKEND_PORTS];
+
+static uint64_t get_time_us();
+static void sleep_until(uint64_t time_us);
+static void pace_output(unsigned long long *start,
+                        unsigned long long *queued,
+                        int samples,
+                        int rate);
+static int get_pending(uint64_t start,
+                       uint64_t queued,
+                       int rate);
+static void write_wav_header(pl_snd_wav_backend *wav);
+
+#ifdef __vita__
+
+static int sce_open(void *data,
+                    int samples,
+                    int rate,
+                    int stereo)
+{
+  return sceAudioOutOpenPort(SCE_AUDIO_OUT_PORT_TYPE_MAIN, samples, rate,
+                             (stereo)
+                               ? SCE_AUDIO_OUT_MODE_STEREO
+                               : SCE_AUDIO_OUT_MODE_MONO);
+}
+
+static void sce_release(void *data,
+                        int port)
+{
+  sceAudioOutReleasePort(port);
+}
+
+static int sce_output(void *data,
+                      int port,
+                      const void *buf)
+{
+  return sceAudioOutOutput(port, buf);
+}
+
+static int sce_set_volume(void *data,
+                          int port,
+                          int left,
+                          int right)
+{
+  int vols[2] = { left, right };
+  return sceAudioOutSetVolume(port,
+                              SCE_AUDIO_VOLUME_FLAG_L_CH
+                                | SCE_AUDIO_VOLUME_FLAG_R_CH,
+                              vols);
+}
+
+static int sce_set_config(void *data,
+                          int port,
+                          int samples,
+                          int rate,
+                          int stereo)
+{
+  return sceAudioOutSetConfig(port, samples, rate,
+                              (stereo < 0) ? -1
+                                : (stereo)
+                                  ? SCE_AUDIO_OUT_MODE_STEREO
+                                  : SCE_AUDIO_OUT_MODE_MONO);
+}
+
+static int sce_get_rest(void *data,
+                        int port)
+{
+  return sceAudioOutGetRestSample(port);
+}
+
+const pl_snd_backend pl_snd_sce_backend =
+{
+  sce_open,
+  sce_release,
+  sce_output,
+  sce_set_volume,
+  sce_set_config,
+  sce_get_rest,
+  NULL
+};
+
+#endif
+
+static int null_open(void *data,
+                     int samples,
+                     int rate,
+                     int stereo)
+{
+  int i;
+  for (i = 0; i < PL_SND_BACKEND_PORTS; i++)
+  {
+    if (!null_ports[i].used)
+    {
+      null_ports[i].used = 1;
+      null_ports[i].samples = samples;
+      null_ports[i].rate = rate;
+      null_ports[i].stereo = stereo;
+      null_ports[i].start = get_time_us();
+      null_ports[i].queued = 0;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void null_release(void *data,
+                         int port)
+{
+  if (port >= 0 && port < PL_SND_BACKEND_PORTS)
+    null_ports[port].used = 0;
+}
+
+static int null_output(void *data,
+                       int port,
+                       const void *buf)
+{
+  null_port *np;
+
+  if (port < 0 || port >= PL_SND_BACKEND_PORTS || !null_ports[port].used)
+    return -1;
+
+  np = &null_ports[port];
+  pace_output(&np->start, &np->queued, (buf) ? np->samples : 0, np->rate);
+
+  return 0;
+}
+
+static int null_set_volume(void *data,
+                           int port,
+                           int left,
+                           int right)
+{
+  return (port >= 0 && port < PL_SND_BACKEND_PORTS
+          && null_ports[port].used) ? 0 : -1;
+}
+
+static int null_set_config(void *data,
+                           int port,
+                           int samples,
+                           int rate,
+                           int stereo)
+{
+  null_port *np;
+
+  if (port < 0 || port >= PL_SND_BACKEND_PORTS || !null_ports[port].used)
+    return -1;
+
+  np = &null_ports[port];
+  if (samples >= 0) np->samples = samples;
+  if (rate >= 0) np->rate = rate;
+  if (stereo >= 0) np->stereo = stereo;
+
+  return 0;
+}
+
+static int null_get_rest(void *data,
+                         int port)
+{
+  null_port *np;
+
+  if (port < 0 || port >= PL_SND_BACKEND_PORTS || !null_ports[port].used)
+    return -1;
+
+  np = &null_ports[port];
+  return get_pending(np->start, np->queued, np->rate);
+}
+
+const pl_snd_backend pl_snd_null_backend =
+{
+  null_open,
+  null_release,
+  null_output,
+  null_set_volume,
+  null_set_config,
+  null_get_rest,
+  NULL
+};
+
+static int wav_open(void *data,
+                    int samples,
+                    int rate,
+                    int stereo)
+{
+  pl_snd_wav_backend *wav = (pl_snd_wav_backend*)data;
+
+  /* One port per file */
+  if (wav->file)
+    return -1;
+  if (!(wav->file = fopen(wav->path, "wb")))
+    return -1;
+
+  wav->samples = samples;
+  wav->rate = rate;
+  wav->stereo = stereo;
+  wav->data_bytes = 0;
+  wav->start = get_time_us();
+  wav->queued = 0;
+
+  /* Sizes are filled in on release */
+  write_wav_header(wav);
+  return 0;
+}
+
+static void wav_release(void *data,
+                        int port)
+{
+  pl_snd_wav_backend *wav = (pl_snd_wav_backend*)data;
+
+  if (!wav->file)
+    return;
+
+  write_wav_header(wav);
+  fclose((FILE*)wav->file);
+  wav->file = NULL;
+}
+
+static int wav_output(void *data,
+                      int port,
+                      const void *buf)
+{
+  pl_snd_wav_backend *wav = (pl_snd_wav_backend*)data;
+  size_t bytes;
+
+  if (!wav->file)
+    return -1;
+
+  if (buf)
+  {
+    bytes = wav->samples * ((wav->stereo) ? 4 : 2);
+    if (fwrite(buf, 1, bytes, (FILE*)wav->file) != bytes)
+      return -1;
+    wav->data_bytes += bytes;
+  }
+
+  if (wav->paced)
+    pace_output(&wav->start, &wav->queued,
+                (buf) ? wav->samples : 0, wav->rate);
+
+  return 0;
+}
+
+/* Volume is a property of the port, not of the recorded data */
+static int wav_set_volume(void *data,
+                          int port,
+                          int left,
+                          int right)
+{
+  return (((pl_snd_wav_backend*)data)->file) ? 0 : -1;
+}
+
+static int wav_set_config(void *data,
+                          int port,
+                          int samples,
+                          int rate,
+                          int stereo)
+{
+  pl_snd_wav_backend *wav = (pl_snd_wav_backend*)data;
+
+  if (!wav->file)
+    return -1;
+
+  /* Format can't change once data has been written */
+  if ((rate >= 0 && rate != wav->rate) ||
+      (stereo >= 0 && stereo != wav->stereo))
+  {
+    if (wav->data_bytes)
+      return -1;
+    if (rate >= 0) wav->rate = rate;
+    if (stereo >= 0) wav->stereo = stereo;
+    write_wav_header(wav);
+  }
+
+  if (samples >= 0)
+    wav->samples = samples;
+
+  return 0;
+}
+
+static int wav_get_rest(void *data,
+                        int port)
+{
+  pl_snd_wav_backend *wav = (pl_snd_wav_backend*)data;
+
+  if (!wav->file)
+    return -1;
+
+  return (wav->paced) ? get_pending(wav->start, wav->queued, wav->rate) : 0;
+}
+
+/* Unpaced, output runs as fast as the audio thread can render it */
+int pl_snd_wav_backend_init(pl_snd_wav_backend *wav,
+                            const char *path,
+                            int paced)
+{
+  if (!(wav->path = strdup(path)))
+    return 0;
+
+  wav->backend.open = wav_open;
+  wav->backend.release = wav_release;
+  wav->backend.output = wav_output;
+  wav->backend.set_volume = wav_set_volume;
+  wav->backend.set_config = wav_set_config;
+  wav->backend.get_rest = wav_get_rest;
+  wav->backend.data = wav;
+  wav->file = NULL;
+  wav->data_bytes = 0;
+  wav->paced = paced;
+
+  return 1;
+}
+
+void pl_snd_wav_backend_destroy(pl_snd_wav_backend *wav)
+{
+  wav_release(wav, 0);
+  free(wav->path);
+  wav->path = NULL;
+}
+
+static void put_le(unsigned char *p,
+                   unsigned int value,
+                   int bytes)
+{
+  for (; bytes > 0; bytes--, value >>= 8)
+    *p++ = value & 0xff;
+}
+
+static void write_wav_header(pl_snd_wav_backend *wav)
+{
+  unsigned char header[WAV_HEADER_SIZE];
+  int channels = (wav->stereo) ? 2 : 1;
+  FILE *file = (FILE*)wav->file;
+  long pos = ftell(file);
+
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, wav->data_bytes + WAV_HEADER_SIZE - 8, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);             /* fmt chunk size */
+  put_le(header + 20, 1, 2);              /* PCM */
+  put_le(header + 22, channels, 2);
+  put_le(header + 24, wav->rate, 4);
+  put_le(header + 28, wav->rate * channels * 2, 4);
+  put_le(header + 32, channels * 2, 2);   /* Block alignment */
+  put_le(header + 34, 16, 2);             /* Bits per sample */
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, wav->data_bytes, 4);
+
+  fseek(file, 0, SEEK_SET);
+  fwrite(header, 1, WAV_HEADER_SIZE, file);
+  if (pos > WAV_HEADER_SIZE)
+    fseek(file, pos, SEEK_SET);
+}
+
+/* Behaves like a port with room for one buffer: blocks until the */
+/* previous buffer has played, then queues 'samples' more. With   */
+/* samples == 0, blocks until everything has played               */
+static void pace_output(unsigned long long *start,
+                        unsigned long long *queued,
+                        int samples,
+                        int rate)
+{
+  uint64_t now = get_time_us();
+  uint64_t end = *start + *queued * 1000000 / rate;
+
+  /* Time is kept from a fixed start, so rounding doesn't drift */
+  if (now < end)
+    sleep_until(end);
+  else if (now > end)
+  {
+    /* Fell behind (or drained); restart the clock */
+    *start = now;
+    *queued = 0;
+  }
+
+  *queued += samples;
+}
+
+static int get_pending(uint64_t start,
+                       uint64_t queued,
+                       int rate)
+{
+  uint64_t now = get_time_us();
+  uint64_t end = start + queued * 1000000 / rate;
+
+  return (now < end) ? (int)((end - now) * rate / 1000000) : 0;
+}
+
+static uint64_t get_time_us()
+{
+#ifdef __vita__
+  return sceKernelGetProcessTimeWide();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void sleep_until(uint64_t time_us)
+{
+#ifdef __vita__
+  uint64_t now = get_time_us();
+  if (time_us > now)
+    sceKernelDelayThread(time_us - now);
+#else
+  struct timespec ts;
+  ts.tv_sec = time_us / 1000000;
+  ts.tv_nsec = (time_us % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
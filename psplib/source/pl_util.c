@@ -33,26 +33,17 @@
 static uint32_t compute_buffer_crc(uint32_t inCrc32,
                                    const void *buf,
                                    size_t bufLen);
+static int get_free_seq_path(const char *path,
+                             const char *filename,
+                             pl_file_path full_path);
 
 int pl_util_save_image_seq(const char *path,
                            const char *filename,
                            const PspImage *image)
 {
-  /* If screenshot path does not exist, create it */
-  if (!pl_file_exists(path))
-    if (!pl_file_mkdir_recursive(path))
-      return 0;
-
-  /* Loop until first free screenshot slot is found */
-  int i = 0;
   pl_file_path full_path;
-  do
-  {
-    snprintf(full_path,
-             sizeof(full_path) - 1,
-             "%s%s-%02i.png",
-             path, filename, i);
-  } while (pl_file_exists(full_path) && ++i < 100);
+  if (!get_free_seq_path(path, filename, full_path))
+    return 0;
 
   /* Save the screenshot */
   return pspImageSavePng(full_path, image);
@@ -72,6 +63,41 @@ int pl_util_save_vram_seq(const char *path,
   return exit_code;
 }
 
+/* Same as pl_util_save_image_seq(), but the PNG is written */
+/* on the image save thread; see pspImageSavePngAsync()     */
+int pl_util_save_image_seq_async(const char *path,
+                                 const char *filename,
+                                 const PspImage *image,
+                                 PspImageSaveCallback callback,
+                                 void *param)
+{
+  pl_file_path full_path;
+  if (!get_free_seq_path(path, filename, full_path))
+    return 0;
+
+  /* The file is created before returning, so the next */
+  /* call will not pick the same slot                  */
+  return pspImageSavePngAsync(full_path, image, callback, param);
+}
+
+int pl_util_save_vram_seq_async(const char *path,
+                                const char *prefix,
+                                PspImageSaveCallback callback,
+                                void *param)
+{
+  PspImage* vram = pspVideoGetVramBufferCopy();
+  if (!vram) return 0;
+
+  int exit_code = pl_util_save_image_seq_async(path,
+                                               prefix,
+                                               vram,
+                                               callback,
+                                               param);
+  pspImageDestroy(vram);
+
+  return exit_code;
+}
+
 int pl_util_date_compare(const SceDateTime *date1,
                          const SceDateTime *date2)
 {
@@ -189,3 +215,25 @@ static uint32_t compute_buffer_crc(uint32_t inCrc32,
     crc32 = (crc32 >> 8) ^ crcTable[ (crc32 ^ byteBuf[i]) & 0xFF ];
   return( crc32 ^ 0xFFFFFFFF );
 }
+
+static int get_free_seq_path(const char *path,
+                             const char *filename,
+                             pl_file_path full_path)
+{
+  /* If screenshot path does not exist, create it */
+  if (!pl_file_exists(path))
+    if (!pl_file_mkdir_recursive(path))
+      return 0;
+
+  /* Loop until first free screenshot slot is found */
+  int i = 0;
+  do
+  {
+    snprintf(full_path,
+             sizeof(pl_file_path) - 1,
+             "%s%s-%02i.png",
+             path, filename, i);
+  } while (pl_file_exists(full_path) && ++i < 100);
+
+  return 1;
+}